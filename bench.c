@@ -0,0 +1,580 @@
+//
+//  bench.c
+//  tetris
+//
+//  Microbenchmarks for the game rules. Each kernel is timed in samples of
+//  about -ms milliseconds and reported as ns per op, with the spread over
+//  the samples, on a few board fixtures.
+//
+//  usage: bench [-samples N] [-ms N] [-only name] [-kernel avx2|sse4|scalar] [-csv]
+//
+//  Kernels that change the board restore it from the fixture every op,
+//  the 'copy' kernel times just that so it can be taken off.
+//
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bot.h"
+#include "game.h"
+
+#define DEFAULT_SAMPLES 15
+#define DEFAULT_MS      20
+#define MAX_SAMPLES     1000
+#define MAX_CANDIDATES  (TET_COUNT * R_COUNT * (BOARD_W + BOARD_PAD))
+
+typedef uint64_t (*kernel_t) (const game_state_t * fixture, uint64_t reps);
+
+typedef struct
+{
+    const char *    name;
+    kernel_t        kernel;
+    int             boards; // bit per fixture to run on, 0 if the board isn't used
+} bench_t;
+
+typedef struct
+{
+    const char *    name;
+    game_state_t    state;
+} fixture_t;
+
+enum
+{
+    FIX_EMPTY,
+    FIX_NEARFULL,
+    FIX_CHECKER,
+    NUMFIXTURES
+};
+
+#define ALLBOARDS   ((1 << NUMFIXTURES) - 1)
+
+fixture_t           fixtures[NUMFIXTURES];
+volatile uint64_t   sink; // results go here so nothing is optimised out
+
+int                 numsamples = DEFAULT_SAMPLES;
+int                 samplems = DEFAULT_MS;
+bool                csv;
+
+
+
+//====================
+//  FIXTURES
+//====================
+
+void SetCell (game_state_t * g, int x, int y, tettype_t type)
+{
+    g->board[y][x] = type;
+    g->rowmask[y] |= 1 << (x + BOARD_PAD);
+}
+
+
+void InitFixtures (void)
+{
+    game_state_t *  g;
+    int             x, y;
+    int             hole;
+
+    for (x=0 ; x<NUMFIXTURES ; x++)
+        InitGame(&fixtures[x].state, 0, 0);
+
+    fixtures[FIX_EMPTY].name = "empty";
+
+    // a hole in every row but the bottom four, which are ready to clear
+    fixtures[FIX_NEARFULL].name = "nearfull";
+    g = &fixtures[FIX_NEARFULL].state;
+    for (y=4 ; y<BOARD_H ; y++)
+    {
+        hole = y < BOARD_H - 4 ? (y * 7) % BOARD_W : -1;
+        for (x=0 ; x<BOARD_W ; x++)
+            if (x != hole)
+                SetCell(g, x, y, (x + y) % TET_COUNT);
+        g->completed[y] = g->rowmask[y] == ROW_FULL;
+    }
+
+    fixtures[FIX_CHECKER].name = "checker";
+    g = &fixtures[FIX_CHECKER].state;
+    for (y=5 ; y<BOARD_H ; y++)
+        for (x=(y & 1) ; x<BOARD_W ; x+=2)
+            SetCell(g, x, y, TET_T);
+}
+
+
+
+//====================
+//  KERNELS
+//====================
+
+//
+// Collision at every position a piece's data can be at, all pieces
+//
+uint64_t BenchCollision (const game_state_t * fixture, uint64_t reps)
+{
+    game_state_t    g = *fixture;
+    uint64_t        ops = 0, hits = 0;
+    int             t, r, x, y;
+
+    while (ops < reps)
+    {
+        for (t=0 ; t<TET_COUNT ; t++)
+            for (r=0 ; r<R_COUNT ; r++)
+            {
+                g.tet.type = t;
+                g.tet.rotation = r;
+                for (y=0 ; y<=BOARD_H ; y++)
+                    for (x=-BOARD_PAD ; x<BOARD_W ; x++)
+                        hits += Collision(&g, x, y);
+                ops += (BOARD_H + 1) * (BOARD_W + BOARD_PAD);
+            }
+    }
+    sink += hits;
+    return ops;
+}
+
+
+//
+// Hard drop from the top of every column the piece fits in
+//
+uint64_t BenchHardDrop (const game_state_t * fixture, uint64_t reps)
+{
+    game_state_t    g = *fixture;
+    uint64_t        ops = 0, depth = 0;
+    int             t, r, x;
+
+    while (ops < reps)
+    {
+        for (t=0 ; t<TET_COUNT ; t++)
+            for (r=0 ; r<R_COUNT ; r++)
+                for (x=-BOARD_PAD ; x<BOARD_W ; x++)
+                {
+                    g.tet.type = t;
+                    g.tet.rotation = r;
+                    g.tet.x = x;
+                    g.tet.y = 0;
+                    if (Collision(&g, x, 0))
+                        continue;
+                    while (MoveTetramino(&g, 0, 1));
+                    depth += g.tet.y;
+                    ops++;
+                }
+    }
+    sink += depth;
+    return ops;
+}
+
+
+//
+// Drop a piece, add it to the board, then take it off again by hand
+//
+uint64_t BenchAdd (const game_state_t * fixture, uint64_t reps)
+{
+    game_state_t    g = *fixture;
+    const piece_t * p;
+    uint64_t        ops = 0;
+    int             t, x, i, y;
+
+    while (ops < reps)
+    {
+        for (t=0 ; t<TET_COUNT ; t++)
+            for (x=0 ; x<BOARD_W - 1 ; x++)
+            {
+                g.tet.type = t;
+                g.tet.rotation = 0;
+                g.tet.x = x;
+                g.tet.y = 0;
+                if (Collision(&g, x, 0))
+                    continue;
+                while (MoveTetramino(&g, 0, 1));
+
+                AddTetraminoToBoard(&g);
+                ops++;
+
+                p = &pieces[t][0];
+                for (i=0 ; i<4 ; i++)
+                    g.board[p->cells[i].y + g.tet.y][p->cells[i].x + x] = -1;
+                for (y=p->miny ; y<=p->maxy ; y++)
+                    g.rowmask[y + g.tet.y] &= ~(p->masks[y] << (x + BOARD_PAD));
+            }
+        g.checkrows = 0;
+    }
+    sink += g.stats[0];
+    return ops;
+}
+
+
+//
+// Restore the board from the fixture, the cost the next two pay
+//
+uint64_t BenchCopy (const game_state_t * fixture, uint64_t reps)
+{
+    game_state_t    g;
+    uint64_t        ops;
+
+    for (ops=0 ; ops<reps ; ops++)
+    {
+        memcpy(&g, fixture, sizeof(g));
+        sink += g.rowmask[BOARD_H - 1];
+    }
+    return ops;
+}
+
+
+//
+// The gravity tick that locks a piece and scans the rows it touched
+//
+uint64_t BenchScan (const game_state_t * fixture, uint64_t reps)
+{
+    game_state_t    g;
+    uint64_t        ops;
+    int             found = 0;
+    int             y;
+
+    for (ops=0 ; ops<reps ; ops++)
+    {
+        memcpy(&g, fixture, sizeof(g));
+        g.tet.type = TET_I;
+        g.tet.rotation = 1;
+        g.tet.x = (int)(ops % (BOARD_W - 1)) - 2;
+        g.tet.y = 0;
+        while (MoveTetramino(&g, 0, 1));
+        g.tet.slide = true;
+        g.checkrows = (1u << BOARD_H) - 1; // as if every row was touched
+        UpdateTetramino(&g);
+        for (y=0 ; y<BOARD_H ; y++)
+            found += g.completed[y];
+    }
+    sink += found;
+    return ops;
+}
+
+
+//
+// Remove whatever lines the fixture has completed
+//
+uint64_t BenchClear (const game_state_t * fixture, uint64_t reps)
+{
+    game_state_t    g;
+    uint64_t        ops;
+    int             lines = 0;
+
+    for (ops=0 ; ops<reps ; ops++)
+    {
+        memcpy(&g, fixture, sizeof(g));
+        lines += ClearLines(&g);
+    }
+    sink += lines;
+    return ops;
+}
+
+
+uint64_t BenchRandom (const game_state_t * fixture, uint64_t reps)
+{
+    game_state_t    g = *fixture;
+    uint64_t        ops, sum = 0;
+
+    for (ops=0 ; ops<reps ; ops++)
+        sum += NextPiece(&g);
+    sink += sum;
+    return ops;
+}
+
+
+//
+// The piece table walk DrawDropGuide does each frame
+//
+uint64_t BenchGuide (const game_state_t * fixture, uint64_t reps)
+{
+    const int8_t *  guide;
+    uint64_t        ops = 0, sum = 0;
+    int             t, r, x;
+
+    (void)fixture; // only the piece table
+    while (ops < reps)
+    {
+        for (t=0 ; t<TET_COUNT ; t++)
+            for (r=0 ; r<R_COUNT ; r++)
+            {
+                guide = pieces[t][r].guide;
+                for (x=0 ; x<DATA_SIZE ; x++)
+                    if (guide[x] != -1)
+                        sum += guide[x] + x;
+                ops++;
+            }
+    }
+    sink += sum;
+    return ops;
+}
+
+
+//
+// Every placement of every piece on the fixture, for the evaluators
+//
+int MakeCandidates (const game_state_t * fixture, evalbatch_t * batches)
+{
+    uint16_t    rows[BOARD_H + DATA_SIZE];
+    int         t, r, x, y, n;
+
+    memset(batches, 0, sizeof(evalbatch_t) * (MAX_CANDIDATES / EVAL_LANES + 1));
+    n = 0;
+    for (t=0 ; t<TET_COUNT ; t++)
+        for (r=0 ; r<R_COUNT ; r++)
+            for (x=-BOARD_PAD ; x<BOARD_W ; x++)
+            {
+                if (DropPiece(fixture->rowmask, t, r, x, 0, rows, NULL) < 0)
+                    continue;
+                for (y=0 ; y<BOARD_H ; y++)
+                    batches[n / EVAL_LANES].rows[y][n % EVAL_LANES] = rows[y];
+                batches[n / EVAL_LANES].count++;
+                n++;
+            }
+    return n;
+}
+
+
+// BoardFeatures a board at a time
+uint64_t BenchFeatures (const game_state_t * fixture, uint64_t reps)
+{
+    static evalbatch_t  batches[MAX_CANDIDATES / EVAL_LANES + 1];
+    uint16_t            boards[MAX_CANDIDATES][BOARD_H];
+    features_t          f;
+    uint64_t            ops = 0, sum = 0;
+    int                 n, i, y;
+
+    n = MakeCandidates(fixture, batches);
+    for (i=0 ; i<n ; i++)
+        for (y=0 ; y<BOARD_H ; y++)
+            boards[i][y] = batches[i / EVAL_LANES].rows[y][i % EVAL_LANES];
+
+    while (ops < reps)
+    {
+        for (i=0 ; i<n ; i++)
+        {
+            BoardFeatures(boards[i], &f);
+            sum += f.height + f.holes + f.bumpiness + f.transitions + f.wells;
+        }
+        ops += n;
+    }
+    sink += sum;
+    return ops;
+}
+
+
+uint64_t RunBatches (const game_state_t * fixture, uint64_t reps,
+                     void (*kernel) (const evalbatch_t *, features_t *))
+{
+    static evalbatch_t  batches[MAX_CANDIDATES / EVAL_LANES + 1];
+    features_t          f[EVAL_LANES];
+    uint64_t            ops = 0, sum = 0;
+    int                 n, i;
+
+    n = MakeCandidates(fixture, batches);
+    while (ops < reps)
+    {
+        for (i=0 ; i*EVAL_LANES<n ; i++)
+        {
+            kernel(&batches[i], f);
+            sum += f[0].height + f[batches[i].count - 1].holes;
+        }
+        ops += n;
+    }
+    sink += sum;
+    return ops;
+}
+
+// the scalar evaluator over the batch layout
+uint64_t BenchBatchScalar (const game_state_t * fixture, uint64_t reps)
+{
+    return RunBatches(fixture, reps, BatchFeaturesScalar);
+}
+
+// the kernel ChooseBatchKernel picked, or -kernel
+uint64_t BenchBatch (const game_state_t * fixture, uint64_t reps)
+{
+    return RunBatches(fixture, reps, BatchFeatures);
+}
+
+
+//
+// CheckBatches
+// Every vector kernel this CPU can run has to agree with BoardFeatures
+// exactly. Leaves the best one chosen.
+//
+bool CheckBatches (void)
+{
+    static const char * names[] = { "avx2", "sse4" };
+    static evalbatch_t  batches[MAX_CANDIDATES / EVAL_LANES + 1];
+    features_t          a[EVAL_LANES], b[EVAL_LANES];
+    int                 n, i, f, k;
+
+    for (k=0 ; k<(int)(sizeof(names) / sizeof(names[0])) ; k++)
+    {
+        if (!ChooseBatchKernel(names[k]))
+            continue;
+        for (f=0 ; f<NUMFIXTURES ; f++)
+        {
+            n = MakeCandidates(&fixtures[f].state, batches);
+            for (i=0 ; i*EVAL_LANES<n ; i++)
+            {
+                BatchFeatures(&batches[i], a);
+                BatchFeaturesScalar(&batches[i], b);
+                if (memcmp(a, b, batches[i].count * sizeof(features_t))) {
+                    fprintf(stderr, "bench: %s batch evaluator disagrees on %s\n",
+                            batchkernel, fixtures[f].name);
+                    return false;
+                }
+            }
+        }
+    }
+    ChooseBatchKernel(NULL);
+    return true;
+}
+
+
+bench_t benches[] =
+{
+    { "collision",   BenchCollision,   ALLBOARDS },
+    { "harddrop",    BenchHardDrop,    ALLBOARDS },
+    { "add",         BenchAdd,         ALLBOARDS },
+    { "copy",        BenchCopy,        0 },
+    { "scan",        BenchScan,        ALLBOARDS },
+    { "clear",       BenchClear,       1 << FIX_NEARFULL }, // the only one with lines
+    { "random",      BenchRandom,      0 },
+    { "guide",       BenchGuide,       0 },
+    { "features",    BenchFeatures,    ALLBOARDS },
+    { "batchscalar", BenchBatchScalar, ALLBOARDS },
+    { "batch",       BenchBatch,       ALLBOARDS },
+};
+
+#define NUMBENCHES  (int)(sizeof(benches) / sizeof(benches[0]))
+
+
+
+#pragma mark -
+
+double Now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+//
+// RunBench
+// Find how many reps fill a sample, then time the samples.
+//
+void RunBench (const bench_t * b, const fixture_t * f)
+{
+    double      samples[MAX_SAMPLES];
+    double      start, seconds, mean, var, min;
+    uint64_t    reps, ops;
+    int         i;
+
+    for (reps=64 ; ; reps*=2)
+    {
+        start = Now();
+        b->kernel(&f->state, reps);
+        if (Now() - start >= samplems * 1e-3 / 4 || reps >= (1ull << 40))
+            break;
+    }
+    reps *= 4;
+
+    mean = 0;
+    min = HUGE_VAL;
+    for (i=0 ; i<numsamples ; i++)
+    {
+        start = Now();
+        ops = b->kernel(&f->state, reps);
+        seconds = Now() - start;
+        samples[i] = seconds * 1e9 / ops;
+        mean += samples[i];
+        if (samples[i] < min)
+            min = samples[i];
+    }
+    mean /= numsamples;
+
+    var = 0;
+    for (i=0 ; i<numsamples ; i++)
+        var += (samples[i] - mean) * (samples[i] - mean);
+    var = numsamples > 1 ? var / (numsamples - 1) : 0;
+
+    if (csv)
+        printf("%s,%s,%.3f,%.3f,%.3f,%d,%llu,%s\n", b->name,
+               b->boards ? f->name : "-", mean, sqrt(var), min,
+               numsamples, (unsigned long long)reps, batchkernel);
+    else
+        printf("%-12s %-9s %10.2f %8.2f %10.2f\n", b->name,
+               b->boards ? f->name : "-", mean, sqrt(var), min);
+}
+
+
+
+int CheckParm (int argc, const char * argv[], const char * parm)
+{
+    int i;
+
+    for (i=1 ; i<argc ; i++)
+        if (!strcmp(argv[i], parm))
+            return i;
+    return 0;
+}
+
+
+
+int main (int argc, const char * argv[])
+{
+    const char *    only = NULL;
+    const char *    kernel = NULL;
+    int             i, f, p;
+
+    if ((p = CheckParm(argc, argv, "-samples")) && p < argc-1)
+        numsamples = atoi(argv[p+1]);
+    if ((p = CheckParm(argc, argv, "-ms")) && p < argc-1)
+        samplems = atoi(argv[p+1]);
+    if ((p = CheckParm(argc, argv, "-only")) && p < argc-1)
+        only = argv[p+1];
+    if ((p = CheckParm(argc, argv, "-kernel")) && p < argc-1)
+        kernel = argv[p+1];
+    csv = CheckParm(argc, argv, "-csv") != 0;
+
+    if (numsamples < 1)
+        numsamples = 1;
+    if (numsamples > MAX_SAMPLES)
+        numsamples = MAX_SAMPLES;
+    if (samplems < 1)
+        samplems = 1;
+
+    InitFixtures();
+    if (!CheckBatches())
+        return 1;
+    if (kernel && !ChooseBatchKernel(kernel)) {
+        fprintf(stderr, "bench: no %s batch kernel on this CPU\n", kernel);
+        return 1;
+    }
+
+    if (csv)
+        printf("kernel,fixture,ns_per_op,stddev,min,samples,reps,batch\n");
+    else
+        printf("%-12s %-9s %10s %8s %10s   (batch: %s)\n", "kernel", "fixture",
+               "ns/op", "stddev", "min", batchkernel);
+
+    for (i=0 ; i<NUMBENCHES ; i++)
+    {
+        if (only && strcmp(only, benches[i].name))
+            continue;
+        if (!benches[i].boards) {
+            RunBench(&benches[i], &fixtures[FIX_EMPTY]);
+            continue;
+        }
+        for (f=0 ; f<NUMFIXTURES ; f++)
+            if (benches[i].boards & 1 << f)
+                RunBench(&benches[i], &fixtures[f]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,505 @@
+//
+//  bot.c
+//  tetris
+//
+//  Autoplayer, see bot.h. Boards are handled as row masks the same as
+//  game.c does, so trying a placement doesn't touch game_state_t.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bot.h"
+
+#define COLUMNS         (ROW_FULL & ~ROW_EMPTY) // bits of the board's columns
+#define EDGES           (((1 << (BOARD_W + 1)) - 1) << (BOARD_PAD - 1)) // cell and the one to its right, walls included
+#define STUCK_FRAMES    3
+#define ARENA_ALIGN(n)  (((n) + 15) & ~(size_t)15)
+#define MIN_TABLE       1024 // transposition table entries, a power of two
+
+// weights from the usual hand-tuned four feature evaluator
+#define W_HEIGHT        -0.510066
+#define W_LINES          0.760666
+#define W_HOLES         -0.35663
+#define W_BUMPINESS     -0.184483
+
+
+double BotTime (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+//
+// InitBot
+// The arena has room for every node a search can make: the root, one
+// child per placement of the current piece, and one per placement of the
+// next piece for each board kept in the beam.
+//
+bool InitBot (bot_t * bot, int beamwidth)
+{
+    size_t  nodes, pointers, tablesize;
+
+    memset(bot, 0, sizeof(*bot));
+    if (beamwidth <= 0)
+        return true;
+
+    bot->beamwidth = beamwidth;
+    nodes = 1 + MAX_PLACEMENTS + (size_t)beamwidth * MAX_PLACEMENTS;
+    pointers = MAX_PLACEMENTS + (size_t)beamwidth * MAX_PLACEMENTS;
+    bot->arena.size = nodes * ARENA_ALIGN(sizeof(searchnode_t))
+                    + ARENA_ALIGN(pointers * sizeof(searchnode_t *)) + ARENA_ALIGN(1);
+    bot->arena.base = malloc(bot->arena.size);
+    for (tablesize=MIN_TABLE ; tablesize < 2 * nodes ; tablesize *= 2)
+        ; // kept under half full so probes stay short
+    bot->table = calloc(tablesize, sizeof(ttentry_t));
+    bot->tablemask = (uint32_t)tablesize - 1;
+    if (!bot->arena.base || !bot->table) {
+        FreeBot(bot);
+        return false;
+    }
+    return true;
+}
+
+
+void FreeBot (bot_t * bot)
+{
+    free(bot->arena.base);
+    free(bot->table);
+    bot->arena.base = NULL;
+    bot->table = NULL;
+    bot->beamwidth = 0;
+}
+
+
+
+#pragma mark - Evaluation
+
+//
+// DropPiece
+// Hard drop a piece from (x, y) on 'board' and put the board that results
+// into 'rows', with any completed lines taken out. If 'hash' is given it
+// is updated from the hash of 'board' to that of 'rows'. Returns the
+// number of lines cleared, or -1 if the piece doesn't fit at (x, y).
+//
+int DropPiece (const uint16_t board[BOARD_H + DATA_SIZE], int type, int rotation, int x, int y,
+               uint16_t rows[BOARD_H + DATA_SIZE], uint64_t * hash)
+{
+    const uint16_t *    mask;
+    int                 shift;
+    int                 i, src, dst, lines;
+
+    shift = x + BOARD_PAD;
+    if (shift < 0 || shift > 16 - DATA_SIZE)
+        return -1;
+
+    // same test as Collision, the floor rows stop the drop
+    mask = pieces[type][rotation].masks;
+#define HITS(y) \
+    (((mask[0] << shift) & board[(y)]) | ((mask[1] << shift) & board[(y)+1]) \
+   | ((mask[2] << shift) & board[(y)+2]) | ((mask[3] << shift) & board[(y)+3]))
+
+    if (HITS(y))
+        return -1;
+    while (!HITS(y + 1))
+        y++;
+#undef HITS
+
+    memcpy(rows, board, (BOARD_H + DATA_SIZE) * sizeof(uint16_t));
+    for (i=0 ; i<DATA_SIZE ; i++)
+    {
+        if (y + i < BOARD_H) {
+            rows[y + i] |= mask[i] << shift;
+            if (hash)
+                *hash ^= RowHash(y + i, mask[i] << shift);
+        }
+    }
+
+    // take out full rows, bottom up
+    lines = 0;
+    for (src=dst=BOARD_H-1 ; src>=0 ; src--)
+    {
+        if (rows[src] == ROW_FULL) {
+            if (hash)
+                *hash ^= RowHash(src, ROW_FULL);
+            lines++;
+            continue;
+        }
+        if (hash && dst != src)
+            *hash ^= RowHash(src, rows[src]) ^ RowHash(dst, rows[src]);
+        rows[dst--] = rows[src];
+    }
+    while (dst >= 0)
+        rows[dst--] = ROW_EMPTY;
+
+    return lines;
+}
+
+
+void BoardFeatures (const uint16_t rows[BOARD_H], features_t * f)
+{
+    int         height[BOARD_W];
+    uint32_t    seen, row, top;
+    int         y, x;
+
+    memset(height, 0, sizeof(height));
+    f->height = f->holes = f->bumpiness = f->transitions = f->wells = 0;
+
+    seen = 0;
+    for (y=0 ; y<BOARD_H ; y++)
+    {
+        row = rows[y];
+        f->transitions += __builtin_popcount((row ^ (row >> 1)) & EDGES);
+        f->wells += __builtin_popcount(~row & ~seen & (row << 1) & (row >> 1) & COLUMNS);
+
+        row &= COLUMNS;
+        for (top = row & ~seen ; top ; top &= top - 1) // highest block in these columns
+            height[__builtin_ctz(top) - BOARD_PAD] = BOARD_H - y;
+        f->holes += __builtin_popcount(seen & ~row);
+        seen |= row;
+    }
+
+    for (x=0 ; x<BOARD_W ; x++)
+    {
+        f->height += height[x];
+        if (x > 0)
+            f->bumpiness += height[x] > height[x-1] ? height[x] - height[x-1] : height[x-1] - height[x];
+    }
+}
+
+
+double ScoreFeatures (const features_t * f)
+{
+    return W_HEIGHT * f->height
+         + W_LINES * f->lines
+         + W_HOLES * f->holes
+         + W_BUMPINESS * f->bumpiness;
+}
+
+
+// score a batch of candidates and keep the best
+void ScoreBatch (const evalbatch_t * batch, const placement_t * cand,
+                 const int * lines, placement_t * best, int * count)
+{
+    features_t  f[EVAL_LANES];
+    int         i;
+
+    BatchFeatures(batch, f);
+    for (i=0 ; i<batch->count ; i++)
+    {
+        f[i].lines = lines[i];
+        if (!*count || ScoreFeatures(&f[i]) > best->score) {
+            *best = cand[i];
+            best->score = ScoreFeatures(&f[i]);
+        }
+        (*count)++;
+    }
+}
+
+
+//
+// BestPlacement
+// Try every rotation and column for the current piece from where it is
+// now. Returns the number of placements scored, 0 if none fit.
+//
+int BestPlacement (const game_state_t * g, placement_t * best)
+{
+    evalbatch_t batch;
+    placement_t cand[EVAL_LANES];
+    int         candlines[EVAL_LANES];
+    uint16_t    rows[BOARD_H + DATA_SIZE];
+    int         r, q, x, y, lines;
+    int         count = 0;
+
+    memset(&batch, 0, sizeof(batch));
+    for (r=0 ; r<R_COUNT ; r++)
+    {
+        // rotations that look the same only need trying once
+        for (q=0 ; q<r ; q++)
+            if (!memcmp(pieces[g->tet.type][q].masks, pieces[g->tet.type][r].masks,
+                        sizeof(pieces[0][0].masks)))
+                break;
+        if (q < r)
+            continue;
+
+        for (x=-BOARD_PAD ; x<BOARD_W ; x++)
+        {
+            lines = DropPiece(g->rowmask, g->tet.type, r, x, g->tet.y, rows, NULL);
+            if (lines < 0)
+                continue;
+
+            for (y=0 ; y<BOARD_H ; y++)
+                batch.rows[y][batch.count] = rows[y];
+            cand[batch.count].x = x;
+            cand[batch.count].rotation = r;
+            candlines[batch.count] = lines;
+            if (++batch.count == EVAL_LANES) {
+                ScoreBatch(&batch, cand, candlines, best, &count);
+                batch.count = 0;
+            }
+        }
+    }
+    if (batch.count)
+        ScoreBatch(&batch, cand, candlines, best, &count);
+
+    return count;
+}
+
+
+
+#pragma mark - Lookahead
+
+void * ArenaAlloc (arena_t * a, size_t size)
+{
+    void *  p;
+
+    size = ARENA_ALIGN(size);
+    if (a->used + size > a->size)
+        return NULL;
+    p = a->base + a->used;
+    a->used += size;
+    return p;
+}
+
+
+//
+// SeenPosition
+// Look up a board in the transposition table and add it if it isn't
+// there. A board at a given depth always has the same lines cleared
+// getting to it, as each piece adds four cells and each line takes ten
+// away, so a board seen before can be skipped without losing anything.
+//
+bool SeenPosition (bot_t * bot, uint64_t hash, int depth)
+{
+    ttentry_t * e;
+    uint64_t    key = hash ^ (uint64_t)(depth + 1) * 0x9E3779B97F4A7C15ull;
+    uint32_t    i;
+
+    bot->probes++;
+    for (i=(uint32_t)key & bot->tablemask ; ; i=(i + 1) & bot->tablemask)
+    {
+        e = &bot->table[i];
+        if (e->search != bot->search) {
+            e->key = key;
+            e->search = bot->search;
+            return false;
+        }
+        if (e->key == key) {
+            bot->hits++;
+            return true;
+        }
+    }
+}
+
+
+void ScoreNodes (searchnode_t ** nodes, int count)
+{
+    evalbatch_t batch;
+    features_t  f[EVAL_LANES];
+    int         i, j, y;
+
+    for (i=0 ; i<count ; i+=EVAL_LANES)
+    {
+        batch.count = count - i < EVAL_LANES ? count - i : EVAL_LANES;
+        for (y=0 ; y<BOARD_H ; y++)
+            for (j=0 ; j<EVAL_LANES ; j++)
+                batch.rows[y][j] = j < batch.count ? nodes[i+j]->rows[y] : ROW_EMPTY;
+        BatchFeatures(&batch, f);
+        for (j=0 ; j<batch.count ; j++)
+        {
+            f[j].lines = nodes[i+j]->lines;
+            nodes[i+j]->score = ScoreFeatures(&f[j]);
+        }
+    }
+}
+
+
+//
+// Expand
+// Every placement of 'type' on each of the 'count' boards in 'level',
+// dropped from row 'y'. The new boards are scored and returned in
+// 'children', and how many there are is returned.
+//
+int Expand (bot_t * bot, searchnode_t ** level, int count, int type, int y, int depth,
+            searchnode_t ** children)
+{
+    searchnode_t *  parent;
+    searchnode_t *  child;
+    uint16_t        rows[BOARD_H + DATA_SIZE];
+    uint64_t        hash;
+    int             n = 0;
+    int             i, r, q, x, lines;
+
+    for (i=0 ; i<count ; i++)
+    {
+        parent = level[i];
+        for (r=0 ; r<R_COUNT ; r++)
+        {
+            for (q=0 ; q<r ; q++)
+                if (!memcmp(pieces[type][q].masks, pieces[type][r].masks,
+                            sizeof(pieces[0][0].masks)))
+                    break;
+            if (q < r)
+                continue;
+
+            for (x=-BOARD_PAD ; x<BOARD_W ; x++)
+            {
+                hash = parent->hash;
+                lines = DropPiece(parent->rows, type, r, x, y, rows, &hash);
+                if (lines < 0)
+                    continue;
+                bot->nodes++;
+                if (SeenPosition(bot, hash, depth))
+                    continue;
+
+                if (!(child = ArenaAlloc(&bot->arena, sizeof(searchnode_t))))
+                    goto full;
+                memcpy(child->rows, rows, sizeof(rows));
+                child->hash = hash;
+                child->lines = parent->lines + lines;
+                if (depth == 0) {
+                    child->first.x = x;
+                    child->first.rotation = r;
+                } else {
+                    child->first = parent->first;
+                }
+                children[n++] = child;
+            }
+        }
+    }
+
+full:
+    ScoreNodes(children, n);
+    bot->evaluated += n;
+    return n;
+}
+
+
+int CompareNodes (const void * a, const void * b)
+{
+    double  sa = (*(searchnode_t * const *)a)->score;
+    double  sb = (*(searchnode_t * const *)b)->score;
+
+    return (sa < sb) - (sa > sb); // best first
+}
+
+
+//
+// BeamSearch
+// Place the current piece every way it fits, keep the best 'beamwidth'
+// boards, and place the next piece on each of those. The current piece
+// goes where the best board at the end came from. Returns false if the
+// current piece doesn't fit anywhere.
+//
+bool BeamSearch (bot_t * bot, const game_state_t * g, placement_t * best)
+{
+    searchnode_t *  root;
+    searchnode_t ** first;
+    searchnode_t ** second;
+    searchnode_t ** level;
+    const piece_t * next;
+    int             count, nextcount, i;
+
+    bot->arena.used = 0;
+    if (++bot->search == 0) { // stamps wrapped, clear out the old ones
+        memset(bot->table, 0, (bot->tablemask + 1) * sizeof(ttentry_t));
+        bot->search = 1;
+    }
+
+    root = ArenaAlloc(&bot->arena, sizeof(searchnode_t));
+    memcpy(root->rows, g->rowmask, sizeof(root->rows));
+    root->hash = g->boardhash;
+    root->lines = 0;
+
+    first = ArenaAlloc(&bot->arena, MAX_PLACEMENTS * sizeof(searchnode_t *));
+    count = Expand(bot, &root, 1, g->tet.type, g->tet.y, 0, first);
+    if (!count)
+        return false;
+
+    qsort(first, count, sizeof(first[0]), CompareNodes);
+    *best = first[0]->first;
+    best->score = first[0]->score;
+    if (count > bot->beamwidth)
+        count = bot->beamwidth;
+
+    next = &pieces[g->nexttet][0];
+    second = ArenaAlloc(&bot->arena, (size_t)count * MAX_PLACEMENTS * sizeof(searchnode_t *));
+    nextcount = Expand(bot, first, count, g->nexttet, next->spawny, 1, second);
+
+    // nowhere for the next piece, go by the current one alone
+    level = nextcount ? second : first;
+    count = nextcount ? nextcount : 1;
+    for (i=0 ; i<count ; i++)
+    {
+        if (i == 0 || level[i]->score > best->score) {
+            *best = level[i]->first;
+            best->score = level[i]->score;
+        }
+    }
+    return true;
+}
+
+
+
+#pragma mark -
+
+//
+// BotInput
+// The input for this frame: plan when a new piece comes in, then rotate
+// and move toward the plan one step a frame and drop when it's there.
+//
+int BotInput (bot_t * bot, const game_state_t * g)
+{
+    double  start;
+    int     count;
+    int     input = 0;
+
+    if (g->tet.spawn || g->fadetimer || g->gameover)
+        return 0; // between pieces
+
+    // a piece was added since the last plan
+    if (memcmp(bot->stats, g->stats, sizeof(bot->stats)))
+        bot->planned = false;
+
+    if (!bot->planned)
+    {
+        start = BotTime();
+        if (bot->beamwidth) {
+            BeamSearch(bot, g, &bot->target);
+        } else {
+            count = BestPlacement(g, &bot->target);
+            bot->evaluated += count;
+            bot->nodes += count;
+        }
+        bot->seconds += BotTime() - start;
+
+        memcpy(bot->stats, g->stats, sizeof(bot->stats));
+        bot->planned = true;
+        bot->stuck = 0;
+        bot->lastx = -100;
+    }
+
+    if (g->tet.rotation != bot->target.rotation)
+        input |= IN_ROTATE;
+    if (g->tet.x < bot->target.x)
+        input |= IN_RIGHT;
+    else if (g->tet.x > bot->target.x)
+        input |= IN_LEFT;
+
+    if (input)
+    {
+        // blocked on the way, settle for here
+        if (g->tet.x == bot->lastx && g->tet.rotation == bot->lastrotation
+            && ++bot->stuck >= STUCK_FRAMES)
+            input = IN_DROP;
+        bot->lastx = g->tet.x;
+        bot->lastrotation = g->tet.rotation;
+        return input;
+    }
+
+    return IN_DROP;
+}
@@ -0,0 +1,119 @@
+//
+//  bot.h
+//  tetris
+//
+//  Autoplayer. For each new piece every rotation and column is tried as a
+//  hard drop, the boards that would result are scored, and the bot then
+//  plays the best one out as ordinary input, a key or two per frame.
+//
+//  With a beam width the next piece is placed too: the best 'beamwidth'
+//  boards after the current piece are each tried with every placement of
+//  the next, and the current piece goes where the best of those came from.
+//
+
+#ifndef bot_h
+#define bot_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "game.h"
+
+// what a board is scored on
+typedef struct
+{
+    int         height; // sum of column heights
+    int         holes; // empty cells with a block somewhere above
+    int         bumpiness; // sum of height differences between columns
+    // these two aren't weighted by ScoreFeatures, they're only there
+    // for callers that want them
+    int         transitions; // filled to empty changes along rows, walls are filled
+    int         wells; // open cells with both sides filled
+    int         lines; // cleared by the placement
+} features_t;
+
+//
+// Candidate boards are scored in batches, stored a row at a time across
+// the batch so row y of every board can be loaded as one vector.
+//
+#define EVAL_LANES      16 // a multiple of every vector width used
+
+typedef struct
+{
+    uint16_t    rows[BOARD_H][EVAL_LANES]; // row y of board i is rows[y][i]
+    int         count;
+} evalbatch_t;
+
+extern const char * batchkernel; // which BatchFeatures is in use, see ChooseBatchKernel
+
+typedef struct
+{
+    int         x;
+    rotation_t  rotation;
+    double      score;
+} placement_t;
+
+#define BOT_BEAM        8 // default beam width, 0 for one piece only
+#define MAX_PLACEMENTS  (R_COUNT * (BOARD_W + BOARD_PAD)) // per piece
+
+// a board reached in the search
+typedef struct
+{
+    uint16_t    rows[BOARD_H + DATA_SIZE]; // floor included, as in game_state_t
+    uint64_t    hash; // BoardHash(rows)
+    int         lines; // cleared since the root
+    double      score;
+    placement_t first; // the move at the root that leads here
+} searchnode_t;
+
+// bump allocator for a search, emptied before each one
+typedef struct
+{
+    uint8_t *   base;
+    size_t      size;
+    size_t      used;
+} arena_t;
+
+// positions seen this search, keyed by board hash and depth
+typedef struct
+{
+    uint64_t    key;
+    uint32_t    search; // which search stored it, older entries are empty
+} ttentry_t;
+
+typedef struct
+{
+    int         beamwidth;
+    arena_t     arena;
+    ttentry_t * table;
+    uint32_t    tablemask;
+    uint32_t    search;
+
+    bool        planned;
+    placement_t target;
+    int         stats[TET_COUNT]; // the game's piece counts when planned
+    int         lastx;
+    rotation_t  lastrotation;
+    int         stuck; // frames a move or rotate didn't happen
+
+    uint64_t    evaluated; // placements scored
+    uint64_t    nodes; // placements tried, duplicates included
+    uint64_t    probes, hits; // transposition table lookups
+    double      seconds; // time spent choosing them
+} bot_t;
+
+bool   InitBot (bot_t * bot, int beamwidth);
+void   FreeBot (bot_t * bot);
+int    BotInput (bot_t * bot, const game_state_t * g);
+
+int    DropPiece (const uint16_t board[BOARD_H + DATA_SIZE], int type, int rotation, int x, int y,
+                  uint16_t rows[BOARD_H + DATA_SIZE], uint64_t * hash);
+void   BoardFeatures (const uint16_t rows[BOARD_H], features_t * f);
+double ScoreFeatures (const features_t * f);
+void   BatchFeatures (const evalbatch_t * b, features_t * out);
+void   BatchFeaturesScalar (const evalbatch_t * b, features_t * out);
+bool   ChooseBatchKernel (const char * name);
+int    BestPlacement (const game_state_t * g, placement_t * best);
+bool   BeamSearch (bot_t * bot, const game_state_t * g, placement_t * best);
+
+#endif /* bot_h */
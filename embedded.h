@@ -0,0 +1,36 @@
+//
+//  embedded.h
+//  tetris
+//
+//  The assets, built into the program so nothing has to be found, read
+//  or decoded at startup. embedded.c is made from assets/ by mkembed,
+//  see the makefile. The font is one bit a pixel, and the sounds are
+//  already in the format the mixer is opened with.
+//
+
+#ifndef embedded_h
+#define embedded_h
+
+#include <stdint.h>
+
+// what Mix_OpenAudio is asked for, signed 16-bit samples in the
+// machine's byte order. Before the sounds were built in it was opened
+// at MIX_DEFAULT_FREQUENCY, which is 22050 before SDL_mixer 2.6
+#define EMBED_FREQUENCY     44100
+#define EMBED_CHANNELS      2
+
+typedef struct
+{
+    const char *    name; // file it came from, without the directory
+    const uint8_t * data;
+    uint32_t        size; // bytes
+} embedsound_t;
+
+extern const int            embedfontw, embedfonth; // pixels
+extern const uint32_t       embedfontcolor; // 0xRRGGBB of set pixels, clear ones are transparent
+extern const uint8_t        embedfont[]; // rows of embedfontw bits, high bit first
+
+extern const embedsound_t   embedsounds[];
+extern const int            numembedsounds;
+
+#endif /* embedded_h */
@@ -0,0 +1,73 @@
+//
+//  evalkernel.h
+//  tetris
+//
+//  The vector BatchFeatures, included by evaluate.c once for each
+//  instruction set with KERNEL, POPCOUNT, TARGET, LANES, vec_t and the
+//  vector operations defined. See evaluate.c for how each feature is
+//  worked out.
+//
+
+// bits set in each 16-bit lane, by looking up each nibble
+__attribute__((target(TARGET)))
+static inline vec_t POPCOUNT (vec_t v, vec_t table, vec_t low4, vec_t low8)
+{
+    vec_t bytes;
+
+    bytes = ADD8(SHUFFLE(table, AND(v, low4)), SHUFFLE(table, AND(SHR(v, 4), low4)));
+    return ADD(AND(bytes, low8), SHR(bytes, 8));
+}
+
+
+__attribute__((target(TARGET)))
+void KERNEL (const evalbatch_t * b, features_t * out)
+{
+    vec_t       table = NIBBLES();
+    vec_t       low4 = SPLAT(0x0f0f);
+    vec_t       low8 = SPLAT(0x00ff);
+    vec_t       columns = SPLAT(COLUMNS);
+    vec_t       edges = SPLAT(EDGES);
+    vec_t       pairs = SPLAT(PAIRS);
+    vec_t       row, above, seen;
+    vec_t       height, holes, bump, trans, wells;
+    uint16_t    result[5][LANES];
+    int         lane, i, y;
+
+    for (lane=0 ; lane<b->count ; lane+=LANES)
+    {
+        height = holes = bump = trans = wells = ZERO();
+        above = ZERO();
+
+        for (y=0 ; y<BOARD_H ; y++)
+        {
+            row = LOAD(&b->rows[y][lane]);
+
+            trans = ADD(trans, POPCOUNT(AND(XOR(row, SHR(row, 1)), edges), table, low4, low8));
+            wells = ADD(wells, POPCOUNT(
+                        ANDNOT(OR(row, above), AND(AND(SHL(row, 1), SHR(row, 1)), columns)),
+                        table, low4, low8));
+
+            row = AND(row, columns);
+            holes = ADD(holes, POPCOUNT(ANDNOT(row, above), table, low4, low8));
+            seen = OR(above, row);
+            height = ADD(height, POPCOUNT(seen, table, low4, low8));
+            bump = ADD(bump, POPCOUNT(AND(XOR(seen, SHR(seen, 1)), pairs), table, low4, low8));
+            above = seen;
+        }
+
+        STORE(result[0], height);
+        STORE(result[1], holes);
+        STORE(result[2], bump);
+        STORE(result[3], trans);
+        STORE(result[4], wells);
+        for (i=0 ; i<LANES && lane+i<b->count ; i++)
+        {
+            out[lane+i].height = result[0][i];
+            out[lane+i].holes = result[1][i];
+            out[lane+i].bumpiness = result[2][i];
+            out[lane+i].transitions = result[3][i];
+            out[lane+i].wells = result[4][i];
+            out[lane+i].lines = 0;
+        }
+    }
+}
@@ -0,0 +1,193 @@
+//
+//  evaluate.c
+//  tetris
+//
+//  Board features for a batch of candidate boards at once. Every feature
+//  is a sum over rows of a popcount of some bitwise mix of the row and the
+//  rows above it, so all the boards in a batch go through the rows in
+//  step, one 16-bit vector lane each:
+//
+//  height      popcount(seen), seen being every column filled at or above
+//              the row. A column of height h is counted in h rows.
+//  bumpiness   popcount((seen ^ seen >> 1) & pairs). Neighbouring columns
+//              differ in seen in as many rows as their heights differ.
+//  holes       popcount(above & ~row), above being seen before this row
+//  transitions popcount((row ^ row >> 1) & edges)
+//  wells       popcount(~row & ~above & row << 1 & row >> 1)
+//
+//  The same results as BoardFeatures, which works them out the obvious
+//  way. On x86 there are AVX2 and SSE4.1 kernels, built whatever the
+//  compiler is targeting, and ChooseBatchKernel picks the best one the
+//  CPU has at startup. Until then, and anywhere else, BoardFeatures is
+//  run one board at a time.
+//
+
+#include <string.h>
+
+#include "bot.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#define COLUMNS     (ROW_FULL & ~ROW_EMPTY)
+#define EDGES       (((1 << (BOARD_W + 1)) - 1) << (BOARD_PAD - 1))
+#define PAIRS       (((1 << (BOARD_W - 1)) - 1) << BOARD_PAD) // columns with one to the right
+
+
+void BatchFeaturesScalar (const evalbatch_t * b, features_t * out)
+{
+    uint16_t    rows[BOARD_H];
+    int         i, y;
+
+    for (i=0 ; i<b->count ; i++)
+    {
+        for (y=0 ; y<BOARD_H ; y++)
+            rows[y] = b->rows[y][i];
+        BoardFeatures(rows, &out[i]);
+        out[i].lines = 0;
+    }
+}
+
+
+
+#ifdef X86_KERNELS
+
+#define LOAD(p)         _mm256_loadu_si256((const __m256i *)(p))
+#define STORE(p, v)     _mm256_storeu_si256((__m256i *)(p), v)
+#define SPLAT(x)        _mm256_set1_epi16(x)
+#define ZERO()          _mm256_setzero_si256()
+#define AND(a, b)       _mm256_and_si256(a, b)
+#define ANDNOT(a, b)    _mm256_andnot_si256(a, b) // ~a & b
+#define OR(a, b)        _mm256_or_si256(a, b)
+#define XOR(a, b)       _mm256_xor_si256(a, b)
+#define SHL(a, n)       _mm256_slli_epi16(a, n)
+#define SHR(a, n)       _mm256_srli_epi16(a, n)
+#define ADD(a, b)       _mm256_add_epi16(a, b)
+#define ADD8(a, b)      _mm256_add_epi8(a, b)
+#define SHUFFLE(t, i)   _mm256_shuffle_epi8(t, i)
+#define NIBBLES()       _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4, \
+                                         0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4)
+#define KERNEL          BatchFeaturesAVX2
+#define POPCOUNT        Popcount16AVX2
+#define TARGET          "avx2"
+#define LANES           16
+#define vec_t           __m256i
+
+#include "evalkernel.h"
+
+#undef LOAD
+#undef STORE
+#undef SPLAT
+#undef ZERO
+#undef AND
+#undef ANDNOT
+#undef OR
+#undef XOR
+#undef SHL
+#undef SHR
+#undef ADD
+#undef ADD8
+#undef SHUFFLE
+#undef NIBBLES
+#undef KERNEL
+#undef POPCOUNT
+#undef TARGET
+#undef LANES
+#undef vec_t
+
+#define LOAD(p)         _mm_loadu_si128((const __m128i *)(p))
+#define STORE(p, v)     _mm_storeu_si128((__m128i *)(p), v)
+#define SPLAT(x)        _mm_set1_epi16(x)
+#define ZERO()          _mm_setzero_si128()
+#define AND(a, b)       _mm_and_si128(a, b)
+#define ANDNOT(a, b)    _mm_andnot_si128(a, b)
+#define OR(a, b)        _mm_or_si128(a, b)
+#define XOR(a, b)       _mm_xor_si128(a, b)
+#define SHL(a, n)       _mm_slli_epi16(a, n)
+#define SHR(a, n)       _mm_srli_epi16(a, n)
+#define ADD(a, b)       _mm_add_epi16(a, b)
+#define ADD8(a, b)      _mm_add_epi8(a, b)
+#define SHUFFLE(t, i)   _mm_shuffle_epi8(t, i)
+#define NIBBLES()       _mm_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4)
+#define KERNEL          BatchFeaturesSSE4
+#define POPCOUNT        Popcount16SSE4
+#define TARGET          "sse4.1"
+#define LANES           8
+#define vec_t           __m128i
+
+#include "evalkernel.h"
+
+#endif
+
+
+
+#pragma mark -
+
+typedef struct
+{
+    const char *    name;
+    const char *    cpu; // __builtin_cpu_supports feature, NULL for any
+    void            (*kernel) (const evalbatch_t * b, features_t * out);
+} batchkernel_t;
+
+// best first
+const batchkernel_t batchkernels[] =
+{
+#ifdef X86_KERNELS
+    { "avx2",   "avx2",     BatchFeaturesAVX2 },
+    { "sse4",   "sse4.1",   BatchFeaturesSSE4 },
+#endif
+    { "scalar", NULL,       BatchFeaturesScalar },
+};
+
+#define NUMBATCHKERNELS (int)(sizeof(batchkernels) / sizeof(batchkernels[0]))
+
+const char *    batchkernel = "scalar";
+void            (*batchfeatures) (const evalbatch_t * b, features_t * out) = BatchFeaturesScalar;
+
+
+bool CPUSupports (const char * feature)
+{
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+    if (!strcmp(feature, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(feature, "sse4.1"))
+        return __builtin_cpu_supports("sse4.1");
+#endif
+    return false;
+}
+
+
+//
+// ChooseBatchKernel
+// Use the kernel called 'name', or the best the CPU has if it's NULL.
+// Call once at startup, before any threads are evaluating. Returns
+// false if 'name' isn't built or the CPU can't run it.
+//
+bool ChooseBatchKernel (const char * name)
+{
+    const batchkernel_t *   k;
+    int                     i;
+
+    for (i=0 ; i<NUMBATCHKERNELS ; i++)
+    {
+        k = &batchkernels[i];
+        if (name && strcmp(name, k->name))
+            continue;
+        if (k->cpu && !CPUSupports(k->cpu))
+            continue;
+        batchkernel = k->name;
+        batchfeatures = k->kernel;
+        return true;
+    }
+    return false;
+}
+
+
+void BatchFeatures (const evalbatch_t * b, features_t * out)
+{
+    batchfeatures(b, out);
+}
@@ -0,0 +1,608 @@
+//
+//  game.c
+//  tetris
+//
+//  Game rules. Nothing in here knows about SDL, sound or drawing: side
+//  effects are reported as EV_* bits for the front end to act on.
+//
+
+#include <string.h>
+
+#include "game.h"
+
+
+//====================
+//  RANDOM NUMBER GENERATOR
+//====================
+
+//
+// xoshiro256** (Blackman and Vigna). Each game has its own, seeded with
+// 64 bits through splitmix64, so any two seeds give unrelated games.
+// JumpRandom moves a generator 2^128 numbers on, which gives streams
+// that can't overlap from a single seed.
+//
+
+uint64_t SplitMix64 (uint64_t * x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+
+void SeedRandom (rng_t * rng, uint64_t seed)
+{
+    int i;
+
+    for (i=0 ; i<4 ; i++)
+        rng->s[i] = SplitMix64(&seed); // never all zero
+}
+
+
+#define ROTL(x, k)  ((x) << (k) | (x) >> (64 - (k)))
+
+uint64_t NextRandom (rng_t * rng)
+{
+    uint64_t *  s = rng->s;
+    uint64_t    result = ROTL(s[1] * 5, 7) * 9;
+    uint64_t    t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = ROTL(s[3], 45);
+    return result;
+}
+
+
+// 0 to n-1, by multiplying out the top 32 bits
+int RandomRange (rng_t * rng, int n)
+{
+    return (int)(((NextRandom(rng) >> 32) * (uint64_t)n) >> 32);
+}
+
+
+void JumpRandom (rng_t * rng)
+{
+    static const uint64_t jump[4] = {
+        0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull,
+        0xa9582618e03fc9aaull, 0x39abdc4529b1661cull
+    };
+    uint64_t    s[4] = { 0, 0, 0, 0 };
+    int         i, b, j;
+
+    for (i=0 ; i<4 ; i++)
+    {
+        for (b=0 ; b<64 ; b++)
+        {
+            if (jump[i] & 1ull << b)
+                for (j=0 ; j<4 ; j++)
+                    s[j] ^= rng->s[j];
+            NextRandom(rng);
+        }
+    }
+    memcpy(rng->s, s, sizeof(s));
+}
+
+
+//
+// NextPiece
+// Uniformly at random, or with GM_BAG the next from a shuffled set of all
+// seven, starting a new set when it runs out.
+//
+int NextPiece (game_state_t * g)
+{
+    int i, j, t;
+
+    if (!(g->flags & GM_BAG))
+        return RandomRange(&g->rng, TET_COUNT);
+
+    if (!g->bagcount)
+    {
+        for (i=0 ; i<TET_COUNT ; i++)
+            g->bag[i] = i;
+        for (i=TET_COUNT-1 ; i>0 ; i--)
+        {
+            j = RandomRange(&g->rng, i + 1);
+            t = g->bag[i];
+            g->bag[i] = g->bag[j];
+            g->bag[j] = t;
+        }
+        g->bagcount = TET_COUNT;
+    }
+    return g->bag[--g->bagcount];
+}
+
+
+
+//====================
+//  ZOBRIST HASHING
+//====================
+
+//
+// A random key per cell, the hash of a board being the xor of the keys
+// of its filled cells. Placing or removing blocks updates it with a few
+// xors instead of going over the whole board. From splitmix64, seed
+// 0x7e7215.
+//
+const uint64_t zobrist[BOARD_H][BOARD_W] = {
+  {
+    0x26a4ca4c153301e6ull, 0x1cf8dc96badab7ccull, 0xcb1ed76cd1e93c1cull,
+    0x1a868221a55d8f8cull, 0xf74f0507c4b5a3ffull, 0xa43b6a04ae16f74full,
+    0x057774a1eeb3b0bdull, 0x6d8546fe4589e937ull, 0xd2901aca0c34668bull,
+    0x481f62f51ec97c80ull
+  },
+  {
+    0xbd45328b109dc23cull, 0x8f87ff83633f4ea4ull, 0x54bdd4b4caf73bfeull,
+    0x00cc038adf418a05ull, 0x991ea9a0d6bbf306ull, 0xe051d9450ead9675ull,
+    0xddb08b860dbe0a18ull, 0x09c480b5d0b95e7eull, 0x01522aec2f1916bdull,
+    0xe88117ea27f48606ull
+  },
+  {
+    0xed50270cede51f84ull, 0x9aca96117a1d09c2ull, 0x733a59d1ac956d76ull,
+    0x644d1072f00126edull, 0xc341284b6bdd9288ull, 0x5eb63f5b4d2f6d57ull,
+    0xb62fee2d3d1bef03ull, 0x214a9d4733482fceull, 0x10f3f3fe81a68006ull,
+    0x57ccf5db6305ab34ull
+  },
+  {
+    0x07e00e545dacfd65ull, 0xe1ab1744bbe1bd7full, 0x0226f42bf5f2f5f0ull,
+    0x4d2df4cacd7a680cull, 0xb947a39672ba6948ull, 0x86a654cf9ea6e5f8ull,
+    0xefc2f9ec40f2680bull, 0xf841eac9afe37a09ull, 0x2de660cfac8308e8ull,
+    0x97521f84d184baf4ull
+  },
+  {
+    0xac0ff5b1cc0f8db2ull, 0xe79433b098b19cc1ull, 0xd5c81f6ab600c447ull,
+    0x45fd398ab99e413aull, 0xc7fc330dec1fd96full, 0xa7264dbe10db9b14ull,
+    0x61fe946add12df88ull, 0x8f1991e4dcfc5d7full, 0x14e8ab2a1b2c370eull,
+    0x4f15ec79976896faull
+  },
+  {
+    0x808d2917bb059cc0ull, 0xf785ebf89ba07db0ull, 0x7f7aa4db1338a39full,
+    0x10e0eee388022a88ull, 0x7a47872def273345ull, 0xc1ac9ce7103f7368ull,
+    0x9a3ba562aaecb42dull, 0x35558187cf76f492ull, 0x9bb6adc0a34ea2b2ull,
+    0x0a09b1c59c4a320dull
+  },
+  {
+    0x3e8cb7f7feb0d486ull, 0xfa6c35358b31fbdeull, 0x302a5ff46c8d1d2cull,
+    0x03da0f4a23899609ull, 0x3f26bc2d43596710ull, 0xf6504eb8dfc7c459ull,
+    0x2b06047faa302c74ull, 0x6cfb7e893a7f1753ull, 0x92d38cbe68f63bc7ull,
+    0xe0fe6b1067e00bfbull
+  },
+  {
+    0x2afa1c97841f6173ull, 0x34e3f7bd817bfb48ull, 0x7b7b8e8fb80a2a41ull,
+    0x07ba56e99c36cb0cull, 0x59e815ae6a082191ull, 0xe3e9f482713820a6ull,
+    0xb0689f81e5401bd5ull, 0xb97e84ccf9c12022ull, 0xcd9c5f870e2cc72cull,
+    0x9a0f785259229316ull
+  },
+  {
+    0xb87448c9eafed151ull, 0x4ac0b801a40822ffull, 0x3b3e89c9ecf13c7dull,
+    0x3f0bfadb07a475f7ull, 0x11ba238b6aee4e15ull, 0x8c1ae1e7c13adb98ull,
+    0xd4bcde2934ea2848ull, 0xf18852f22bd71869ull, 0x4a8851d767f0abefull,
+    0x1a297b8dabebc1efull
+  },
+  {
+    0x935201373bf75c13ull, 0x2761aade9039256bull, 0xfda715d01e792138ull,
+    0x035c8589498cd357ull, 0xd1997b4303810f87ull, 0x6239dea25c0263e8ull,
+    0xd32da03f4470af70ull, 0x5d5d574c3b0291a4ull, 0xb9e5514d83e0120cull,
+    0x5901c1bb9c7a9072ull
+  },
+  {
+    0xa8d32d7757d0f6b7ull, 0x6abd65f46fb43879ull, 0x1641d4575b59f85aull,
+    0x89fefe8cfc88778dull, 0x5b9844438087fcceull, 0xbb8e6859ed4586faull,
+    0x1fd4083eb4e79730ull, 0x0da4abc1baf2378eull, 0x35a9f24d96b46fc6ull,
+    0x34de84c865071a50ull
+  },
+  {
+    0x9c7c309723b684b5ull, 0xd0385c1c6b80fdecull, 0xab3ed1b0e8773ca5ull,
+    0xd0734ab95f1ccf18ull, 0x8f21ea5e8f3eb2f0ull, 0xd05fa102317241e9ull,
+    0x5d1da550ec961e45ull, 0x9b0237be93345672ull, 0xa69f653c8268f6bfull,
+    0xfb76cb7b89f02cd7ull
+  },
+  {
+    0x0ec37e082a784454ull, 0xaba0aba6a2304a09ull, 0xe30c31c1faea8c81ull,
+    0x492724e0eab14d59ull, 0x06d9c7de1f112a11ull, 0xd6d15c105ec54236ull,
+    0x09187143fa80c919ull, 0x0699dddabc744627ull, 0xb4fe8f37f84f41fbull,
+    0xf4c3c972c15e2511ull
+  },
+  {
+    0xe83ecf3d4324564aull, 0x5e7a5a8942fa0f2dull, 0x241e0051ee5ba86eull,
+    0x833bfdb7753c50e2ull, 0x0f8f7b76db4477d9ull, 0x24d5e884aa73f982ull,
+    0x4f2e97849cfa93d6ull, 0x0fd0c3c46e5e3067ull, 0xe51b74f087625834ull,
+    0x2ecc59971a6a772bull
+  },
+  {
+    0x4a72ad64ee54325cull, 0x8e82fff9dd05aa49ull, 0x830b6ddbbc9727e6ull,
+    0xd41c81075e2b90b2ull, 0x1494738ffa8dcc5eull, 0x2422e61f2cc30dccull,
+    0x2da278830ee57367ull, 0x91b86643aaf23810ull, 0x8513aa6b6e686f7full,
+    0x3cf03f77666461acull
+  },
+  {
+    0x3e1435997bfe44b7ull, 0x3700c0c48c2c6d8cull, 0xa1b88db1ec008a2eull,
+    0xfe329fe36a6b657aull, 0x25bb826c6feaaf77ull, 0xdffd2a55cf8661beull,
+    0x1cff59d770a878d5ull, 0x5d2647d45fedabfaull, 0xfe3437910cccb6f7ull,
+    0xf1187d908a8616f6ull
+  },
+  {
+    0x4860f4a241738c24ull, 0xf32a89550348969full, 0x841954625d056da2ull,
+    0x5b92b59d7cd0a9d0ull, 0x2cae18e2ac23cae5ull, 0x988d68a640492101ull,
+    0x655a077485d78768ull, 0x17f89472a569f3a1ull, 0xf8b64faadf29aa96ull,
+    0x6d76e5a1e4513633ull
+  },
+  {
+    0x03931d3b23e4f097ull, 0x77a1012a487ba22bull, 0x4a1965cee7ad5c20ull,
+    0x8a33d6cf0f489fc9ull, 0x89a3644cb06bd790ull, 0x82d7d95d8b2d6d0cull,
+    0xb130102e7f20b0b8ull, 0x96d97004f00cf4baull, 0x725fa97d1ec039b6ull,
+    0xc81293c6c9bcc576ull
+  },
+  {
+    0x10a384421721cf3cull, 0x62cdafeb8a62b646ull, 0x9666b65e1e73c70full,
+    0xcc7af9d0862fe3eaull, 0x5af9c1b39262f1b9ull, 0xd7cd5040552debc4ull,
+    0xe8a29ba24c1126b0ull, 0x238fa4c7a8f9111bull, 0xcca8fdd2a433f27bull,
+    0x8c8bbba791b4f58eull
+  },
+  {
+    0xfe5a0610d950ef57ull, 0x1daf63e6eb688bfeull, 0x4c1e7ec1fbeed0f8ull,
+    0x4e79eb24a381d58bull, 0x5ecc8a69856b1806ull, 0x8e716d95b3253a00ull,
+    0x5aa52040c71da3abull, 0xfc7f38ce863ecdd6ull, 0x7ccf6ea2f33eadebull,
+    0x3c9510c1b054caedull
+  },
+  {
+    0x69e4ac6884efe2b8ull, 0x37c914bb6d6a083cull, 0x986106afe5295eb7ull,
+    0x17ea8b984648ed28ull, 0x20ac02186dae4f93ull, 0x5143a422d84c4ce4ull,
+    0x97592af013e07c2dull, 0xac6bab154994514aull, 0x0f3719c75087e71cull,
+    0x56e4d4019fa34211ull
+  }
+};
+
+
+// the keys of the filled cells in a row mask, for row y
+uint64_t RowHash (int y, uint32_t row)
+{
+    uint64_t    hash = 0;
+
+    for (row &= ROW_FULL & ~ROW_EMPTY ; row ; row &= row - 1)
+        hash ^= zobrist[y][__builtin_ctz(row) - BOARD_PAD];
+    return hash;
+}
+
+
+uint64_t BoardHash (const uint16_t rows[BOARD_H])
+{
+    uint64_t    hash = 0;
+    int         y;
+
+    for (y=0 ; y<BOARD_H ; y++)
+        hash ^= RowHash(y, rows[y]);
+    return hash;
+}
+
+
+
+
+void InitGame (game_state_t * g, uint64_t seed, int flags)
+{
+    int y;
+
+    memset(g, 0, sizeof(*g));
+    memset(g->board, -1, sizeof(g->board));
+    for (y=0 ; y<BOARD_H ; y++)
+        g->rowmask[y] = ROW_EMPTY;
+    for ( ; y<BOARD_H + DATA_SIZE ; y++)
+        g->rowmask[y] = ROW_FULL; // floor
+
+    SeedRandom(&g->rng, seed);
+    g->flags = flags;
+    g->level = INITIAL_LVL;
+    g->cyclelength = INITIAL_CYCLE;
+    g->cycletimer = g->cyclelength;
+    g->tet.spawn = true;
+    g->tet.slide = false;
+    g->nexttet = NextPiece(g);
+}
+
+
+
+//
+// Collision
+// Check for collision between 'tet' (player's piece)
+// and the side, bottom, or blocks already on the board
+//
+bool Collision (const game_state_t * g, int checkx, int checky)
+{
+    const uint16_t *    mask;
+    const uint16_t *    row;
+    int                 shift;
+
+    shift = checkx + BOARD_PAD;
+    if (shift < 0 || shift > 16 - DATA_SIZE)
+        return true; // well past a side
+
+    // the wall bits and the solid rows below the board take care of
+    // hitting the sides and bottom
+    mask = pieces[g->tet.type][g->tet.rotation].masks;
+    row = &g->rowmask[checky];
+
+    return ((mask[0] << shift) & row[0])
+        || ((mask[1] << shift) & row[1])
+        || ((mask[2] << shift) & row[2])
+        || ((mask[3] << shift) & row[3]);
+}
+
+
+
+
+int SpawnTetramino (game_state_t * g)
+{
+    tetramino_t * tet = &g->tet;
+
+    memset(tet, 0, sizeof(tetramino_t));
+
+    tet->type = g->nexttet;
+    g->nexttet = NextPiece(g);
+    tet->rotation = 0;
+    tet->x = pieces[tet->type][tet->rotation].spawnx;
+    tet->y = pieces[tet->type][tet->rotation].spawny;
+
+    if (Collision(g, tet->x, tet->y)) {
+        g->gameover = true;
+        return EV_SPAWN | EV_GAMEOVER;
+    }
+    return EV_SPAWN;
+}
+
+
+
+
+//
+// MoveTetramino
+// - Try to move the player-controlled tet
+// does not move and returns false
+// if the move results in a collision
+//
+bool MoveTetramino (game_state_t * g, int dx, int dy)
+{
+    if (!Collision(g, g->tet.x + dx, g->tet.y + dy)) {
+        g->tet.x += dx;
+        g->tet.y += dy;
+        return true;
+    }
+    return false;
+}
+
+
+
+bool RotateTetramino (game_state_t * g)
+{
+    g->tet.rotation = (g->tet.rotation + 1) % R_COUNT;
+
+    if (Collision(g, g->tet.x, g->tet.y)) { // if collision, rotate it back
+        g->tet.rotation = (g->tet.rotation - 1) % R_COUNT;
+        return false;
+    }
+    return true;
+}
+
+
+
+void AddTetraminoToBoard (game_state_t * g)
+{
+    const tetramino_t * tet = &g->tet;
+    const piece_t *     p;
+    int                 i, y;
+
+    p = &pieces[tet->type][tet->rotation];
+    for (i=0 ; i<4 ; i++)
+    {
+        g->board[p->cells[i].y + tet->y][p->cells[i].x + tet->x] = tet->type;
+        g->boardhash ^= zobrist[p->cells[i].y + tet->y][p->cells[i].x + tet->x];
+    }
+    for (y=p->miny ; y<=p->maxy ; y++)
+        g->rowmask[y + tet->y] |= p->masks[y] << (tet->x + BOARD_PAD);
+
+    // only these rows can have been completed
+    g->checkrows |= ((1u << (p->maxy - p->miny + 1)) - 1) << (tet->y + p->miny);
+
+    g->stats[tet->type] = (g->stats[tet->type] + 1) % 999;
+    g->tet.spawn = true;
+}
+
+
+
+//
+//  UpdateTetramino
+//  Move tet down, and add to board if collision.
+//  Mark completed lines, and set cycle timer accordingly.
+//
+int UpdateTetramino (game_state_t * g)
+{
+    int         y;
+    int         tics;
+    uint32_t    rows;
+
+    tics = g->cyclelength;
+
+    // give a small amount of time to slide the piece
+    if (Collision(g, g->tet.x, g->tet.y + 1) && !g->tet.slide) {
+        g->tet.slide = true;
+        return SLIDE_TIME;
+    }
+    g->tet.slide = false;
+
+    // MOVE DOWN
+    if (!MoveTetramino(g, 0, 1))
+    {
+        AddTetraminoToBoard(g);
+        tics = 0;
+    }
+
+    // mark any completed rows among those pieces were added to
+    rows = g->checkrows & ((1u << BOARD_H) - 1);
+    g->checkrows = 0;
+    while (rows)
+    {
+        y = __builtin_ctz(rows);
+        rows &= rows - 1;
+        if (g->rowmask[y] == ROW_FULL)
+        {
+            g->completed[y] = true;
+            g->fadetimer += 15; // clearing more lines takes longer
+        }
+    }
+
+    return tics;
+}
+
+
+
+//
+//  ClearLines
+//  Remove all completed rows in a single pass from the bottom up, moving
+//  each remaining row straight to where it ends up. Returns the number
+//  of rows removed.
+//
+int ClearLines (game_state_t * g)
+{
+    int         src, dst;
+    uint32_t    check;
+
+    // nothing below the lowest completed row moves
+    for (src=BOARD_H-1 ; src>=0 && !g->completed[src] ; src--)
+        ;
+    if (src < 0)
+        return 0;
+
+    check = g->checkrows & ((1u << (src + 1)) - 1);
+    g->checkrows &= ~check;
+    for (dst=src ; src>=0 ; src--)
+    {
+        if (g->completed[src]) {
+            g->completed[src] = false;
+            g->boardhash ^= RowHash(src, ROW_FULL);
+            continue;
+        }
+        if (dst != src) {
+            memcpy(g->board[dst], g->board[src], BOARD_W);
+            g->rowmask[dst] = g->rowmask[src];
+            g->boardhash ^= RowHash(src, g->rowmask[dst]) ^ RowHash(dst, g->rowmask[dst]);
+        }
+        g->checkrows |= ((check >> src) & 1) << dst;
+        dst--;
+    }
+
+    // the rows at the top come in empty
+    memset(g->board, -1, (dst + 1) * BOARD_W);
+    for (src=0 ; src<=dst ; src++)
+        g->rowmask[src] = ROW_EMPTY;
+
+    return dst + 1;
+}
+
+
+
+//
+//  UpdateGame
+//  Advance the game by one frame, not counting player input.
+//  Returns EV_* bits for anything that happened.
+//
+int UpdateGame (game_state_t * g)
+{
+    int linecnt;
+    int events = 0;
+
+    if (g->fadetimer) {
+        --g->fadetimer;
+        return 0; // don't process anything while line(s) fading
+    }
+
+    if (g->tet.spawn) {
+        events |= SpawnTetramino(g);
+        g->tet.spawn = false;
+    }
+
+    // remove completed lines
+    linecnt = ClearLines(g);
+    g->score += 25 * linecnt;
+    g->numlines += linecnt;
+
+    if (linecnt == 4)
+        events |= EV_TETRIS;
+    else if (linecnt)
+        events |= EV_LINE;
+    events |= linecnt << EV_LINESHIFT;
+
+
+    // CHECK FOR NEXT LEVEL
+
+    if (g->numlines / LINES_PER_LVL > g->level ) {
+        g->level++;
+        g->cyclelength -= CYCLE_DECR;
+        if (g->cyclelength < CYCLE_DECR)
+            g->cyclelength = CYCLE_DECR;
+        events |= EV_LEVELUP;
+    }
+
+
+    // MOVE PIECE DOWN ONCE PER CYCLE
+
+    if (--g->cycletimer <= 0) {
+        g->cycletimer = UpdateTetramino(g);
+        if (g->tet.spawn)
+            events |= EV_LOCK;
+    }
+
+    return events;
+}
+
+
+
+//
+//  StepGame
+//  Apply one frame's worth of input, then advance the game one frame.
+//
+int StepGame (game_state_t * g, int input)
+{
+    int events = 0;
+
+    // between pieces the last one is already on the board
+    if (!g->tet.spawn && !g->fadetimer)
+    {
+        if (input & IN_ROTATE) {
+            if (RotateTetramino(g))
+                events |= EV_ROTATE;
+        }
+
+        if (input & IN_LEFT) {
+            if (MoveTetramino(g, -1, 0))
+                events |= EV_MOVE;
+        }
+
+        if (input & IN_RIGHT) {
+            if (MoveTetramino(g, 1, 0))
+                events |= EV_MOVE;
+        }
+
+        if (input & IN_DROP) {
+            while (MoveTetramino(g, 0, 1));
+            AddTetraminoToBoard(g);
+            g->score += 5;
+            g->cycletimer = 0;
+            events |= EV_DROP | EV_LOCK;
+        }
+    }
+
+    // debug:
+    if (input & IN_ADDLINES)
+        g->numlines += LINES_PER_LVL;
+    if (input & IN_SUBLINES) {
+        g->numlines -= LINES_PER_LVL;
+        if (g->numlines < 0) g->numlines = 0;
+    }
+
+    events |= UpdateGame(g);
+    g->frame++;
+
+    return events;
+}
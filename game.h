@@ -0,0 +1,123 @@
+//
+//  game.h
+//  tetris
+//
+//  The rules of the game, with no dependency on SDL. All state for one game
+//  lives in a game_state_t that is advanced one frame at a time by StepGame.
+//
+
+#ifndef game_h
+#define game_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tetramino.h"
+
+#define BOARD_W         10
+#define BOARD_H         21 // visible area is 20 tall
+
+#define INITIAL_LVL     0
+#define LINES_PER_LVL   10
+#define INITIAL_CYCLE   60
+#define CYCLE_DECR      5   // cycle time 5 less each level
+#define SLIDE_TIME      30
+
+// each board row is also kept as a bit mask, column x at bit x + BOARD_PAD,
+// with the unused bits on either side set so they act as walls
+#define BOARD_PAD       3
+#define ROW_FULL        0xFFFF
+#define ROW_EMPTY       (ROW_FULL & ((ROW_FULL << (BOARD_W + BOARD_PAD)) | ((1 << BOARD_PAD) - 1)))
+
+// player input for one frame, one bit per key pressed during the frame
+enum
+{
+    IN_ROTATE   = 1 << 0,
+    IN_LEFT     = 1 << 1,
+    IN_RIGHT    = 1 << 2,
+    IN_DROP     = 1 << 3,
+    IN_ADDLINES = 1 << 4, // debug
+    IN_SUBLINES = 1 << 5, // debug
+};
+
+// what happened during a frame, returned by StepGame so the caller can
+// play sounds etc.
+enum
+{
+    EV_MOVE     = 1 << 0,
+    EV_ROTATE   = 1 << 1,
+    EV_DROP     = 1 << 2,
+    EV_LOCK     = 1 << 3, // piece added to the board
+    EV_SPAWN    = 1 << 4,
+    EV_LINE     = 1 << 5, // one to three lines cleared
+    EV_TETRIS   = 1 << 6, // four lines cleared
+    EV_LEVELUP  = 1 << 7,
+    EV_GAMEOVER = 1 << 8,
+};
+
+// rule options, fixed for a game
+enum
+{
+    GM_BAG      = 1 << 0, // pieces come in shuffled sets of all seven
+};
+
+// number of lines cleared is stored above the event bits
+#define EV_LINESHIFT    12
+#define EV_LINECOUNT(ev) (((ev) >> EV_LINESHIFT) & 7)
+
+// xoshiro256**, see game.c
+typedef struct
+{
+    uint64_t        s[4];
+} rng_t;
+
+typedef struct
+{
+    tetramino_t     tet; // player-controlled tetramino
+    tettype_t       nexttet;
+    signed char     board[BOARD_H][BOARD_W]; // -1 unoccupied, >= 0 tettype_t
+    uint16_t        rowmask[BOARD_H + DATA_SIZE]; // occupancy, rows below are solid
+    bool            completed[BOARD_H]; // list of completed lines
+    uint32_t        checkrows; // bit y set if row y changed since last check
+    uint64_t        boardhash; // zobrist hash of the filled cells, see RowHash
+
+    int             score;
+    int             level;
+    int             numlines;
+    int             stats[TET_COUNT];
+
+    int             cyclelength;
+    int             cycletimer; // i.e. game speed, in frames
+    int             fadetimer;
+
+    rng_t           rng; // only draws pieces, so input can't change them
+    int             flags; // GM_*
+    uint8_t         bag[TET_COUNT]; // GM_BAG, pieces still to come
+    int             bagcount;
+    int             frame; // number of frames stepped
+    bool            gameover;
+} game_state_t;
+
+extern const uint64_t zobrist[BOARD_H][BOARD_W];
+
+void InitGame (game_state_t * g, uint64_t seed, int flags);
+int  StepGame (game_state_t * g, int input);
+
+uint64_t SplitMix64 (uint64_t * x);
+void     SeedRandom (rng_t * rng, uint64_t seed);
+uint64_t NextRandom (rng_t * rng);
+int      RandomRange (rng_t * rng, int n);
+void     JumpRandom (rng_t * rng);
+int      NextPiece (game_state_t * g);
+uint64_t RowHash (int y, uint32_t row);
+uint64_t BoardHash (const uint16_t rows[BOARD_H]);
+bool Collision (const game_state_t * g, int checkx, int checky);
+int  SpawnTetramino (game_state_t * g);
+bool MoveTetramino (game_state_t * g, int dx, int dy);
+bool RotateTetramino (game_state_t * g);
+void AddTetraminoToBoard (game_state_t * g);
+int  UpdateTetramino (game_state_t * g);
+int  ClearLines (game_state_t * g);
+int  UpdateGame (game_state_t * g);
+
+#endif /* game_h */
@@ -0,0 +1,192 @@
+//
+//  mkembed.c
+//  tetris
+//
+//  Build step: turns the font and sounds into embedded.c, see embedded.h.
+//  The font has to be a single colour on transparent so it fits in a bit
+//  a pixel. Sounds are converted to the mixer's format here rather than
+//  when they're loaded.
+//
+//  usage: mkembed out.c font.png sound.wav ...
+//
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include <SDL2_image/SDL_image.h>
+
+#include "embedded.h"
+
+
+// aligned, as the mixer reads the sounds in place a sample at a time
+void WriteBytes (FILE * out, const char * name, const uint8_t * data, size_t size)
+{
+    size_t i;
+
+    fprintf(out, "_Alignas(8) const uint8_t %s[%zu] =\n{", name, size ? size : 1);
+    for (i=0 ; i<size ; i++)
+        fprintf(out, "%s0x%02x,", i % 16 ? " " : "\n    ", data[i]);
+    fprintf(out, "%s\n};\n\n", size ? "" : "\n    0");
+}
+
+
+//
+// WriteFont
+// Every pixel has to be either transparent or the one colour.
+//
+bool WriteFont (FILE * out, const char * filename)
+{
+    SDL_Surface *   loaded;
+    SDL_Surface *   s;
+    uint8_t *       bits;
+    uint8_t *       pixel;
+    uint32_t        color = 0, c;
+    size_t          rowbytes;
+    int             x, y;
+    bool            found = false;
+
+    loaded = IMG_Load(filename);
+    if (!loaded) {
+        fprintf(stderr, "mkembed: Error! Could not load %s: %s\n", filename, SDL_GetError());
+        return false;
+    }
+    s = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_RGBA32, 0);
+    SDL_FreeSurface(loaded);
+    if (!s)
+        return false;
+
+    rowbytes = (s->w + 7) / 8;
+    bits = calloc(rowbytes, s->h);
+    if (!bits) {
+        SDL_FreeSurface(s);
+        return false;
+    }
+
+    SDL_LockSurface(s);
+    for (y=0 ; y<s->h ; y++)
+    {
+        for (x=0 ; x<s->w ; x++)
+        {
+            pixel = (uint8_t *)s->pixels + y * s->pitch + x * 4; // R, G, B, A
+            if (!pixel[3])
+                continue;
+            c = pixel[0] << 16 | pixel[1] << 8 | pixel[2];
+            if (pixel[3] != 255 || (found && c != color)) {
+                fprintf(stderr, "mkembed: Error! %s has more than one colour at %d, %d\n",
+                        filename, x, y);
+                SDL_UnlockSurface(s);
+                SDL_FreeSurface(s);
+                free(bits);
+                return false;
+            }
+            color = c;
+            found = true;
+            bits[y * rowbytes + x / 8] |= 0x80 >> (x % 8);
+        }
+    }
+    SDL_UnlockSurface(s);
+
+    fprintf(out, "const int embedfontw = %d, embedfonth = %d;\n", s->w, s->h);
+    fprintf(out, "const uint32_t embedfontcolor = 0x%06x;\n\n", color);
+    WriteBytes(out, "embedfont", bits, rowbytes * s->h);
+
+    SDL_FreeSurface(s);
+    free(bits);
+    return true;
+}
+
+
+// returns false if it can't be loaded or converted
+bool WriteSound (FILE * out, const char * filename, int index, uint32_t * size)
+{
+    SDL_AudioSpec   spec;
+    SDL_AudioCVT    cvt;
+    Uint8 *         wav;
+    Uint32          length;
+    char            name[32];
+
+    if (!SDL_LoadWAV(filename, &spec, &wav, &length)) {
+        fprintf(stderr, "mkembed: Error! Could not load %s: %s\n", filename, SDL_GetError());
+        return false;
+    }
+    if (SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq,
+                          AUDIO_S16SYS, EMBED_CHANNELS, EMBED_FREQUENCY) < 0) {
+        fprintf(stderr, "mkembed: Error! Can't convert %s: %s\n", filename, SDL_GetError());
+        SDL_FreeWAV(wav);
+        return false;
+    }
+
+    cvt.len = length;
+    cvt.buf = malloc((size_t)length * cvt.len_mult);
+    if (!cvt.buf) {
+        SDL_FreeWAV(wav);
+        return false;
+    }
+    memcpy(cvt.buf, wav, length);
+    SDL_FreeWAV(wav);
+    if (cvt.needed && SDL_ConvertAudio(&cvt) < 0) {
+        fprintf(stderr, "mkembed: Error! Can't convert %s: %s\n", filename, SDL_GetError());
+        free(cvt.buf);
+        return false;
+    }
+
+    snprintf(name, sizeof(name), "sound%d", index);
+    *size = cvt.needed ? cvt.len_cvt : cvt.len;
+    WriteBytes(out, name, cvt.buf, *size);
+    free(cvt.buf);
+    return true;
+}
+
+
+int main (int argc, const char * argv[])
+{
+    const char *    base;
+    uint32_t *      sizes;
+    FILE *          out;
+    int             i;
+    bool            ok;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: mkembed out.c font.png sound.wav ...\n");
+        return 1;
+    }
+
+    sizes = calloc(argc, sizeof(*sizes));
+    out = fopen(argv[1], "w");
+    if (!sizes || !out) {
+        fprintf(stderr, "mkembed: Error! Could not create %s\n", argv[1]);
+        return 1;
+    }
+
+    fprintf(out, "//\n//  %s\n//  tetris\n//\n//  Made by mkembed, don't edit.\n//\n\n", argv[1]);
+    fprintf(out, "#include \"embedded.h\"\n\n");
+
+    ok = WriteFont(out, argv[2]);
+    for (i=3 ; ok && i<argc ; i++)
+        ok = WriteSound(out, argv[i], i - 3, &sizes[i]);
+
+    if (ok)
+    {
+        fprintf(out, "const embedsound_t embedsounds[] =\n{\n");
+        for (i=3 ; i<argc ; i++)
+        {
+            base = strrchr(argv[i], '/');
+            fprintf(out, "    { \"%s\", sound%d, %u },\n",
+                    base ? base + 1 : argv[i], i - 3, sizes[i]);
+        }
+        if (argc == 3)
+            fprintf(out, "    { \"\", 0, 0 },\n");
+        fprintf(out, "};\n\nconst int numembedsounds = %d;\n", argc - 3);
+    }
+
+    if (fclose(out) != 0)
+        ok = false;
+    free(sizes);
+    if (!ok) {
+        remove(argv[1]); // don't leave half a file for make to think is done
+        return 1;
+    }
+    return 0;
+}
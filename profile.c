@@ -0,0 +1,159 @@
+//
+//  profile.c
+//  tetris
+//
+//  Frame profiler, see profile.h. Empty unless built with PROFILE.
+//
+
+#include "profile.h"
+
+#ifdef PROFILE
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RING_SIZE       (1 << 16) // power of two
+
+//
+// The main thread is the only writer. Each record is filled in before the
+// head is published with a release store, so a reader that loads the head
+// with acquire can read everything behind it (minus what was overwritten)
+// without a lock.
+//
+typedef struct
+{
+    uint64_t    start; // ns
+    uint32_t    duration; // ns
+    uint16_t    phase;
+    uint16_t    counts[NUMCOUNTERS]; // PH_FRAME only
+} record_t;
+
+record_t            ring[RING_SIZE];
+_Atomic uint64_t    ringhead;
+
+int                 profcounts[NUMCOUNTERS];
+uint64_t            phasestart[NUMPHASES];
+
+float               history[PROF_HISTORY]; // frame times, ms
+int                 numhistory;
+int                 lastcounts[NUMCOUNTERS];
+
+const char * phasenames[NUMPHASES] =
+{
+    "frame", "events", "update", "background", "panels", "board", "window", "present"
+};
+
+
+uint64_t ProfTime (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void ProfBegin (int phase)
+{
+    phasestart[phase] = ProfTime();
+}
+
+
+void ProfEnd (int phase)
+{
+    uint64_t    head;
+    record_t *  r;
+    int         i;
+
+    head = atomic_load_explicit(&ringhead, memory_order_relaxed);
+    r = &ring[head & (RING_SIZE - 1)];
+    r->start = phasestart[phase];
+    r->duration = (uint32_t)(ProfTime() - phasestart[phase]);
+    r->phase = phase;
+    for (i=0 ; i<NUMCOUNTERS ; i++)
+        r->counts[i] = phase == PH_FRAME ? profcounts[i] : 0;
+    atomic_store_explicit(&ringhead, head + 1, memory_order_release);
+
+    if (phase == PH_FRAME)
+        history[numhistory++ % PROF_HISTORY] = r->duration / 1e6f;
+}
+
+
+//
+// ProfFrame
+// Call after PROF_END(PH_FRAME), starts counting the next frame.
+//
+void ProfFrame (void)
+{
+    memcpy(lastcounts, profcounts, sizeof(profcounts));
+    memset(profcounts, 0, sizeof(profcounts));
+}
+
+
+int CompareTimes (const void * a, const void * b)
+{
+    float fa = *(const float *)a;
+    float fb = *(const float *)b;
+
+    return (fa > fb) - (fa < fb);
+}
+
+
+void ProfSummary (profsummary_t * s)
+{
+    float   sorted[PROF_HISTORY];
+    int     n;
+
+    memset(s, 0, sizeof(*s));
+    memcpy(s->counts, lastcounts, sizeof(lastcounts));
+
+    n = numhistory < PROF_HISTORY ? numhistory : PROF_HISTORY;
+    if (n == 0)
+        return;
+    memcpy(sorted, history, n * sizeof(float));
+    qsort(sorted, n, sizeof(float), CompareTimes);
+    s->p50 = sorted[n / 2];
+    s->p99 = sorted[n * 99 / 100];
+}
+
+
+//
+// ProfWriteTrace
+// Dump the ring buffer as Chrome trace event JSON (chrome://tracing or
+// ui.perfetto.dev). Frames also get a counter track for draw calls.
+//
+bool ProfWriteTrace (const char * filename)
+{
+    FILE *      f;
+    uint64_t    head, i, first;
+    record_t *  r;
+
+    f = fopen(filename, "w");
+    if (!f)
+        return false;
+
+    head = atomic_load_explicit(&ringhead, memory_order_acquire);
+    first = head > RING_SIZE ? head - RING_SIZE : 0;
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (i=first ; i<head ; i++)
+    {
+        r = &ring[i & (RING_SIZE - 1)];
+        fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                "\"ts\":%.3f,\"dur\":%.3f}",
+                i == first ? "" : ",\n", phasenames[r->phase],
+                r->start / 1e3, r->duration / 1e3);
+        if (r->phase == PH_FRAME)
+            fprintf(f, ",\n{\"name\":\"draws\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,"
+                    "\"args\":{\"fill\":%d,\"copy\":%d}}",
+                    r->start / 1e3, r->counts[PC_FILL], r->counts[PC_COPY]);
+    }
+    fprintf(f, "\n]}\n");
+
+    return fclose(f) == 0;
+}
+
+#endif /* PROFILE */
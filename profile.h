@@ -0,0 +1,80 @@
+//
+//  profile.h
+//  tetris
+//
+//  Frame profiler. Build with 'make PROFILE=1' to turn it on, otherwise
+//  every macro here expands to nothing.
+//
+//  Phases are timed with PROF_BEGIN/PROF_END and recorded into a ring
+//  buffer, PROF_FRAME closes out a frame. Include after SDL.h so the
+//  render calls get counted.
+//
+
+#ifndef profile_h
+#define profile_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum
+{
+    PH_FRAME,       // one pass through PlayLoop, not counting the wait
+    PH_EVENTS,
+    PH_UPDATE,
+    PH_BACKGROUND,  // static layer
+    PH_PANELS,
+    PH_BOARD,
+    PH_WINDOW,
+    PH_PRESENT,
+    NUMPHASES
+};
+
+enum
+{
+    PC_FILL,        // rects, points and clears
+    PC_COPY,        // texture copies
+    NUMCOUNTERS
+};
+
+#ifdef PROFILE
+
+#define PROF_HISTORY    128 // frames kept for the overlay
+
+typedef struct
+{
+    float       p50, p99; // frame time, ms
+    int         counts[NUMCOUNTERS]; // in the last frame
+} profsummary_t;
+
+extern int profcounts[NUMCOUNTERS];
+
+void ProfBegin (int phase);
+void ProfEnd (int phase);
+void ProfFrame (void);
+void ProfSummary (profsummary_t * s);
+bool ProfWriteTrace (const char * filename);
+
+#define PROF_BEGIN(ph)  ProfBegin(ph)
+#define PROF_END(ph)    ProfEnd(ph)
+#define PROF_FRAME()    ProfFrame()
+#define PROF_COUNT(c)   (profcounts[c]++)
+
+// count render calls, a macro isn't expanded again inside itself
+#define SDL_RenderClear(r)              (PROF_COUNT(PC_FILL), SDL_RenderClear(r))
+#define SDL_RenderFillRect(r, a)        (PROF_COUNT(PC_FILL), SDL_RenderFillRect(r, a))
+#define SDL_RenderFillRects(r, a, n)    (PROF_COUNT(PC_FILL), SDL_RenderFillRects(r, a, n))
+#define SDL_RenderDrawPoints(r, a, n)   (PROF_COUNT(PC_FILL), SDL_RenderDrawPoints(r, a, n))
+#define SDL_RenderCopy(r, t, s, d)      (PROF_COUNT(PC_COPY), SDL_RenderCopy(r, t, s, d))
+#define SDL_RenderGeometry(r, t, v, nv, i, ni) \
+    (PROF_COUNT(PC_COPY), SDL_RenderGeometry(r, t, v, nv, i, ni))
+
+#else
+
+#define PROF_BEGIN(ph)  ((void)0)
+#define PROF_END(ph)    ((void)0)
+#define PROF_FRAME()    ((void)0)
+#define PROF_COUNT(c)   ((void)0)
+
+#endif /* PROFILE */
+
+#endif /* profile_h */
@@ -0,0 +1,615 @@
+//
+//  replay.c
+//  tetris
+//
+//  Replay files are little-endian:
+//
+//  header      "TRPL", u16 version, u16 GM_* flags, u64 seed, u32 keyinterval
+//  blocks      one per keyframe, every keyinterval frames:
+//              keyframe    the game state at the start of the frame
+//              events      (varint frame delta, u8 input) for each frame
+//                          with input up to the next keyframe, the delta
+//                          is from the previous event or the keyframe
+//  index       numkeyframes * (u32 frame, u64 offset of keyframe)
+//  trailer     u64 index offset, u32 numkeyframes, u32 numevents,
+//              u32 frames, i32 score, i32 lines, i32 level, "TRPX", u32 0
+//
+//  The trailer is a fixed size at the end of the file, so a reader finds
+//  the index from there and can go straight to any keyframe.
+//
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "replay.h"
+
+#define HEADER_SIZE     20
+#define INDEX_SIZE      12
+#define TRAILER_SIZE    40
+#define TRAILER_MAGIC   "TRPX"
+#define KEYFRAME_SIZE   (4 + 5 + 1 + 32 + 2 + TET_COUNT + BOARD_H * BOARD_W + 8 + 12 + TET_COUNT * 2 + 6)
+
+typedef struct
+{
+    uint8_t *   data;
+    size_t      size;
+    size_t      max;
+    bool        error;
+} buffer_t;
+
+
+void InitReplay (replay_t * r, uint64_t seed, int flags)
+{
+    memset(r, 0, sizeof(*r));
+    r->seed = seed;
+    r->flags = flags;
+}
+
+
+void FreeReplay (replay_t * r)
+{
+    free(r->events);
+    memset(r, 0, sizeof(*r));
+}
+
+
+//
+// RecordInput
+// Add the input for a frame, before it's given to StepGame. Frames with
+// no input aren't stored. Returns false if out of memory.
+//
+bool RecordInput (replay_t * r, int frame, int input)
+{
+    replayevent_t * events;
+
+    if (!input)
+        return true;
+
+    if (r->numevents == r->maxevents)
+    {
+        r->maxevents = r->maxevents ? r->maxevents * 2 : 1024;
+        events = realloc(r->events, r->maxevents * sizeof(replayevent_t));
+        if (!events)
+            return false;
+        r->events = events;
+    }
+
+    r->events[r->numevents].frame = frame;
+    r->events[r->numevents].input = input;
+    r->numevents++;
+    return true;
+}
+
+
+// store how the game stands, to check playback against
+void FinishReplay (replay_t * r, const game_state_t * g)
+{
+    r->frames = g->frame;
+    r->score = g->score;
+    r->lines = g->numlines;
+    r->level = g->level;
+}
+
+
+
+#pragma mark - Encoding
+
+void PutBytes (buffer_t * b, const void * data, size_t size)
+{
+    uint8_t * grown;
+
+    if (b->size + size > b->max)
+    {
+        b->max = b->max ? b->max * 2 : 4096;
+        if (b->max < b->size + size)
+            b->max = b->size + size;
+        grown = realloc(b->data, b->max);
+        if (!grown) {
+            b->error = true;
+            return;
+        }
+        b->data = grown;
+    }
+    if (!b->error) {
+        memcpy(b->data + b->size, data, size);
+        b->size += size;
+    }
+}
+
+void PutByte (buffer_t * b, int v)
+{
+    uint8_t byte = v;
+
+    PutBytes(b, &byte, 1);
+}
+
+void Put16 (buffer_t * b, uint32_t v)
+{
+    uint8_t p[2] = { v, v >> 8 };
+
+    PutBytes(b, p, 2);
+}
+
+void Put32 (buffer_t * b, uint32_t v)
+{
+    uint8_t p[4] = { v, v >> 8, v >> 16, v >> 24 };
+
+    PutBytes(b, p, 4);
+}
+
+void Put64 (buffer_t * b, uint64_t v)
+{
+    Put32(b, (uint32_t)v);
+    Put32(b, (uint32_t)(v >> 32));
+}
+
+// 7 bits at a time, low first, top bit set if more follow
+void PutVarint (buffer_t * b, uint32_t v)
+{
+    while (v >= 0x80) {
+        PutByte(b, (v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    PutByte(b, v);
+}
+
+
+uint32_t Get16 (const uint8_t * p)
+{
+    return p[0] | p[1] << 8;
+}
+
+uint32_t Get32 (const uint8_t * p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint64_t Get64 (const uint8_t * p)
+{
+    return Get32(p) | (uint64_t)Get32(p + 4) << 32;
+}
+
+// returns false if it runs past 'end' or is too long
+bool GetVarint (const uint8_t ** p, const uint8_t * end, uint32_t * v)
+{
+    int shift;
+
+    *v = 0;
+    for (shift=0 ; shift<35 && *p<end ; shift+=7)
+    {
+        *v |= (uint32_t)(**p & 0x7f) << shift;
+        if (!(*(*p)++ & 0x80))
+            return true;
+    }
+    return false;
+}
+
+
+
+#pragma mark - Keyframes
+
+void PutKeyframe (buffer_t * b, const game_state_t * g)
+{
+    uint32_t    completed = 0;
+    int         y, i;
+
+    for (y=0 ; y<BOARD_H ; y++)
+        completed |= (uint32_t)g->completed[y] << y;
+
+    Put32(b, g->frame);
+    PutByte(b, g->tet.x);
+    PutByte(b, g->tet.y);
+    PutByte(b, g->tet.type);
+    PutByte(b, g->tet.rotation);
+    PutByte(b, g->tet.spawn | g->tet.slide << 1 | g->gameover << 2);
+    PutByte(b, g->nexttet);
+    for (i=0 ; i<4 ; i++)
+        Put64(b, g->rng.s[i]);
+    PutByte(b, g->flags);
+    PutByte(b, g->bagcount);
+    PutBytes(b, g->bag, TET_COUNT);
+    PutBytes(b, g->board, BOARD_H * BOARD_W);
+    Put32(b, completed);
+    Put32(b, g->checkrows);
+    Put32(b, g->score);
+    Put32(b, g->level);
+    Put32(b, g->numlines);
+    for (i=0 ; i<TET_COUNT ; i++)
+        Put16(b, g->stats[i]);
+    Put16(b, g->cyclelength);
+    Put16(b, g->cycletimer);
+    Put16(b, g->fadetimer);
+}
+
+
+//
+// GetKeyframe
+// The occupancy masks and hash aren't stored, they're rebuilt from the board.
+// Returns false if the keyframe doesn't make sense.
+//
+bool GetKeyframe (const uint8_t * p, game_state_t * g)
+{
+    const piece_t * piece;
+    int             x, y, i;
+
+    memset(g, 0, sizeof(*g));
+    g->frame = Get32(p); p += 4;
+    g->tet.x = (int8_t)p[0];
+    g->tet.y = (int8_t)p[1];
+    g->tet.type = p[2];
+    g->tet.rotation = p[3];
+    g->tet.spawn = p[4] & 1;
+    g->tet.slide = (p[4] >> 1) & 1;
+    g->gameover = (p[4] >> 2) & 1;
+    g->nexttet = p[5];
+    p += 6;
+    for (i=0 ; i<4 ; i++, p+=8)
+        g->rng.s[i] = Get64(p);
+    g->flags = p[0];
+    g->bagcount = p[1];
+    memcpy(g->bag, p + 2, TET_COUNT);
+    p += 2 + TET_COUNT;
+
+    if (g->tet.type >= TET_COUNT || g->tet.rotation >= R_COUNT
+        || g->nexttet >= TET_COUNT || g->bagcount > TET_COUNT)
+        return false;
+    // the piece is drawn and indexed into the board whatever state it's
+    // in, so all of it has to be on the board. Pieces only move down from
+    // y 0, and GameOver starts from its y
+    piece = &pieces[g->tet.type][g->tet.rotation];
+    if (g->tet.x + piece->minx < 0 || g->tet.x + piece->maxx >= BOARD_W
+        || g->tet.y < 0 || g->tet.y + piece->maxy >= BOARD_H)
+        return false;
+    for (i=0 ; i<g->bagcount ; i++)
+        if (g->bag[i] >= TET_COUNT)
+            return false;
+
+    memcpy(g->board, p, BOARD_H * BOARD_W);
+    p += BOARD_H * BOARD_W;
+    for (y=0 ; y<BOARD_H ; y++)
+    {
+        g->rowmask[y] = ROW_EMPTY;
+        for (x=0 ; x<BOARD_W ; x++)
+        {
+            if (g->board[y][x] < -1 || g->board[y][x] >= TET_COUNT)
+                return false;
+            if (g->board[y][x] != -1)
+                g->rowmask[y] |= 1 << (x + BOARD_PAD);
+        }
+    }
+    for ( ; y<BOARD_H + DATA_SIZE ; y++)
+        g->rowmask[y] = ROW_FULL;
+    g->boardhash = BoardHash(g->rowmask);
+
+    for (y=0 ; y<BOARD_H ; y++)
+        g->completed[y] = (Get32(p) >> y) & 1;
+    g->checkrows = Get32(p + 4);
+    g->score = Get32(p + 8);
+    g->level = Get32(p + 12);
+    g->numlines = Get32(p + 16);
+    p += 20;
+    for (i=0 ; i<TET_COUNT ; i++, p+=2)
+        g->stats[i] = Get16(p);
+    g->cyclelength = (int16_t)Get16(p);
+    g->cycletimer = (int16_t)Get16(p + 2);
+    g->fadetimer = (int16_t)Get16(p + 4);
+
+    if (g->cyclelength < 0 || g->fadetimer < 0)
+        return false;
+    // a live piece has to be somewhere it could have got to
+    if (!g->tet.spawn && !g->gameover && Collision(g, g->tet.x, g->tet.y))
+        return false;
+
+    return true;
+}
+
+
+
+#pragma mark - Files
+
+//
+// WriteReplay
+// The recording only has input, so the game is run again from the seed
+// to get the keyframes.
+//
+bool WriteReplay (const replay_t * r, const char * filename, int keyinterval)
+{
+    buffer_t        b;
+    buffer_t        index;
+    game_state_t    g;
+    FILE *          stream;
+    uint64_t        indexoffset;
+    uint32_t        last = 0;
+    int             numkeyframes = 0;
+    int             numevents = 0;
+    int             i;
+    bool            ok;
+
+    if (keyinterval < 1)
+        keyinterval = REPLAY_KEYINTERVAL;
+    memset(&b, 0, sizeof(b));
+    memset(&index, 0, sizeof(index));
+
+    PutBytes(&b, REPLAY_MAGIC, 4);
+    Put16(&b, REPLAY_VERSION);
+    Put16(&b, r->flags);
+    Put64(&b, r->seed);
+    Put32(&b, keyinterval);
+
+    InitGame(&g, r->seed, r->flags);
+    for (i=0 ; ; )
+    {
+        if (g.frame % keyinterval == 0) {
+            Put32(&index, g.frame);
+            Put64(&index, b.size);
+            PutKeyframe(&b, &g);
+            last = g.frame;
+            numkeyframes++;
+        }
+        if (g.gameover || g.frame >= r->frames)
+            break;
+
+        while (i < r->numevents && r->events[i].frame < (uint32_t)g.frame)
+            i++;
+        if (i < r->numevents && r->events[i].frame == (uint32_t)g.frame) {
+            PutVarint(&b, g.frame - last);
+            PutByte(&b, r->events[i].input);
+            last = g.frame;
+            numevents++;
+            StepGame(&g, r->events[i++].input);
+        } else {
+            StepGame(&g, 0);
+        }
+    }
+
+    indexoffset = b.size;
+    PutBytes(&b, index.data, index.size);
+    Put64(&b, indexoffset);
+    Put32(&b, numkeyframes);
+    Put32(&b, numevents);
+    Put32(&b, r->frames);
+    Put32(&b, r->score);
+    Put32(&b, r->lines);
+    Put32(&b, r->level);
+    PutBytes(&b, TRAILER_MAGIC, 4);
+    Put32(&b, 0);
+
+    ok = !b.error && !index.error;
+    if (ok) {
+        stream = fopen(filename, "wb");
+        ok = stream && fwrite(b.data, b.size, 1, stream) == 1;
+        if (stream && fclose(stream) != 0)
+            ok = false;
+    }
+
+    free(b.data);
+    free(index.data);
+    return ok;
+}
+
+
+uint32_t KeyframeNumber (const replayfile_t * f, int k)
+{
+    return Get32(f->index + k * INDEX_SIZE);
+}
+
+const uint8_t * KeyframeData (const replayfile_t * f, int k)
+{
+    return f->data + Get64(f->index + k * INDEX_SIZE + 4);
+}
+
+
+//
+// OpenReplay
+// Map a replay file and check that its index is sound, nothing else is
+// read until it's needed.
+//
+bool OpenReplay (replayfile_t * f, const char * filename)
+{
+    struct stat     st;
+    const uint8_t * t;
+    uint64_t        offset, prev;
+    void *          data;
+    int             fd, k;
+
+    memset(f, 0, sizeof(*f));
+    fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return false;
+    if (fstat(fd, &st) == -1 || st.st_size < HEADER_SIZE + TRAILER_SIZE) {
+        close(fd);
+        return false;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays
+    if (data == MAP_FAILED)
+        return false;
+    f->data = data;
+    f->size = st.st_size;
+
+    if (memcmp(f->data, REPLAY_MAGIC, 4) || Get16(f->data + 4) != REPLAY_VERSION)
+        goto fail;
+    f->flags = Get16(f->data + 6);
+    f->seed = Get64(f->data + 8);
+    f->keyinterval = Get32(f->data + 16);
+
+    t = f->data + f->size - TRAILER_SIZE;
+    if (memcmp(t + 32, TRAILER_MAGIC, 4))
+        goto fail;
+    f->indexoffset = Get64(t);
+    f->numkeyframes = Get32(t + 8);
+    f->numevents = Get32(t + 12);
+    f->frames = Get32(t + 16);
+    f->score = Get32(t + 20);
+    f->lines = Get32(t + 24);
+    f->level = Get32(t + 28);
+
+    // the index fills the space up to the trailer exactly. Offsets come
+    // from the file, so nothing is added to them where it could wrap
+    if (f->numkeyframes < 1 || f->keyinterval < 1
+        || f->indexoffset < HEADER_SIZE + KEYFRAME_SIZE
+        || f->indexoffset > f->size - TRAILER_SIZE
+        || (f->size - TRAILER_SIZE - f->indexoffset) % INDEX_SIZE
+        || (f->size - TRAILER_SIZE - f->indexoffset) / INDEX_SIZE != (uint64_t)f->numkeyframes)
+        goto fail;
+    f->index = f->data + f->indexoffset;
+
+    // keyframes in order, each whole and before the index
+    prev = 0;
+    for (k=0 ; k<f->numkeyframes ; k++)
+    {
+        offset = Get64(f->index + k * INDEX_SIZE + 4);
+        if (offset < HEADER_SIZE || offset > f->indexoffset - KEYFRAME_SIZE
+            || (k && (offset < prev + KEYFRAME_SIZE
+                      || KeyframeNumber(f, k) <= KeyframeNumber(f, k-1))))
+            goto fail;
+        prev = offset;
+    }
+    return true;
+
+fail:
+    CloseReplay(f);
+    return false;
+}
+
+
+void CloseReplay (replayfile_t * f)
+{
+    if (f->data)
+        munmap((void *)f->data, f->size);
+    memset(f, 0, sizeof(*f));
+}
+
+
+
+#pragma mark - Playback
+
+void EnterBlock (replaycursor_t * c, int k)
+{
+    const replayfile_t * f = c->file;
+
+    c->block = k;
+    c->p = KeyframeData(f, k) + KEYFRAME_SIZE;
+    c->end = k + 1 < f->numkeyframes ? KeyframeData(f, k + 1) : f->index;
+    c->lastframe = KeyframeNumber(f, k);
+}
+
+
+// decode the event after the current one
+void NextEvent (replaycursor_t * c)
+{
+    uint32_t delta;
+
+    while (1)
+    {
+        if (c->p >= c->end)
+        {
+            if (c->block + 1 >= c->file->numkeyframes) {
+                c->nextframe = UINT32_MAX;
+                return;
+            }
+            EnterBlock(c, c->block + 1);
+            continue;
+        }
+        if (GetVarint(&c->p, c->end, &delta) && c->p < c->end)
+            break;
+        c->p = c->end; // bad block, skip the rest of it
+    }
+
+    c->nextframe = c->lastframe + delta;
+    c->nextinput = *c->p++;
+    c->lastframe = c->nextframe;
+}
+
+
+//
+// CursorInput
+// Get the input for 'frame'. Frames have to be asked for in order.
+//
+int CursorInput (replaycursor_t * c, int frame)
+{
+    int input;
+
+    while (c->nextframe < (uint32_t)frame)
+        NextEvent(c);
+    if (c->nextframe != (uint32_t)frame)
+        return 0;
+
+    input = c->nextinput;
+    NextEvent(c);
+    return input;
+}
+
+
+//
+// SeekReplay
+// Set 'g' to how the game stood at the start of 'frame' (or the end of
+// the game if it's past that), from the nearest keyframe before it.
+// 'c' is left ready to read input from there.
+//
+bool SeekReplay (const replayfile_t * f, int frame, game_state_t * g, replaycursor_t * c)
+{
+    int lo, hi, mid;
+
+    // last keyframe at or before 'frame'
+    lo = 0;
+    hi = f->numkeyframes - 1;
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        if (KeyframeNumber(f, mid) <= (uint32_t)frame)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    if (!GetKeyframe(KeyframeData(f, lo), g))
+        return false;
+
+    c->file = f;
+    EnterBlock(c, lo);
+    NextEvent(c);
+
+    while (!g->gameover && g->frame < frame && g->frame < f->frames)
+        StepGame(g, CursorInput(c, g->frame));
+    return true;
+}
+
+
+// does the game end up where the recording did?
+bool CheckReplay (const replayfile_t * f, const game_state_t * g)
+{
+    return g->frame == f->frames
+        && g->score == f->score
+        && g->numlines == f->lines
+        && g->level == f->level;
+}
+
+
+//
+// PlayReplay
+// Run the whole game from the start as fast as possible and check how it
+// ends. No keyframe is trusted, not even the first: the game starts from
+// the seed and only the input is read from the file.
+//
+bool PlayReplay (const replayfile_t * f, game_state_t * g)
+{
+    replaycursor_t c;
+
+    InitGame(g, f->seed, f->flags);
+    if (KeyframeNumber(f, 0) != 0)
+        return false;
+
+    c.file = f;
+    EnterBlock(&c, 0);
+    NextEvent(&c);
+    while (!g->gameover && g->frame < f->frames)
+        StepGame(g, CursorInput(&c, g->frame));
+    return CheckReplay(f, g);
+}
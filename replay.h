@@ -0,0 +1,92 @@
+//
+//  replay.h
+//  tetris
+//
+//  Recorded games. A game is fully determined by its seed and the input
+//  given to StepGame each frame, so that is all a replay keeps, along with
+//  how the game ended so playback can be checked against it. Files also
+//  hold a snapshot of the whole game state every so often, so playback
+//  can start anywhere without running the game from the beginning.
+//
+
+#ifndef replay_h
+#define replay_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+
+#define REPLAY_MAGIC        "TRPL"
+#define REPLAY_VERSION      4
+#define REPLAY_KEYINTERVAL  600 // frames between keyframes, 10 seconds
+
+typedef struct
+{
+    uint32_t        frame;
+    uint8_t         input; // IN_* bits
+} replayevent_t;
+
+// a game being recorded
+typedef struct
+{
+    uint64_t        seed;
+    int             flags; // GM_*
+    replayevent_t * events; // only frames with input
+    int             numevents;
+    int             maxevents;
+
+    // the end of the game
+    int             frames;
+    int             score;
+    int             lines;
+    int             level;
+} replay_t;
+
+// a replay file, mapped into memory and read in place
+typedef struct
+{
+    const uint8_t * data;
+    size_t          size;
+
+    uint64_t        seed;
+    int             flags;
+    int             keyinterval;
+    int             numkeyframes;
+    const uint8_t * index; // numkeyframes entries, see replay.c
+    uint64_t        indexoffset;
+
+    int             numevents;
+    int             frames;
+    int             score;
+    int             lines;
+    int             level;
+} replayfile_t;
+
+// reads the input in a replay file in frame order
+typedef struct
+{
+    const replayfile_t * file;
+    int             block; // keyframe whose events are being read
+    const uint8_t * p;
+    const uint8_t * end;
+    uint32_t        lastframe;
+    uint32_t        nextframe; // next event, UINT32_MAX if none
+    int             nextinput;
+} replaycursor_t;
+
+void InitReplay (replay_t * r, uint64_t seed, int flags);
+void FreeReplay (replay_t * r);
+bool RecordInput (replay_t * r, int frame, int input);
+void FinishReplay (replay_t * r, const game_state_t * g);
+bool WriteReplay (const replay_t * r, const char * filename, int keyinterval);
+
+bool OpenReplay (replayfile_t * f, const char * filename);
+void CloseReplay (replayfile_t * f);
+bool SeekReplay (const replayfile_t * f, int frame, game_state_t * g, replaycursor_t * c);
+int  CursorInput (replaycursor_t * c, int frame);
+bool CheckReplay (const replayfile_t * f, const game_state_t * g);
+bool PlayReplay (const replayfile_t * f, game_state_t * g);
+
+#endif /* replay_h */
@@ -0,0 +1,290 @@
+//
+//  replaycheck.c
+//  tetris
+//
+//  Replay files that have been tampered with, each of which has to be
+//  turned down by OpenReplay, PlayReplay or SeekReplay without reading
+//  outside the file. A game is recorded and written, then each case
+//  changes a copy of it and reopens it.
+//
+//  usage: replaycheck [-seed N]
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "game.h"
+#include "replay.h"
+
+#define CHECKFILE       "replaycheck.trp"
+#define KEYINTERVAL     60
+#define MAX_FRAMES      20000
+
+// see the layout in replay.c
+#define HEADER_SIZE     20
+#define TRAILER_SIZE    40
+
+uint8_t *   original;
+size_t      originalsize;
+uint8_t *   data; // the copy each case changes
+size_t      size;
+
+
+
+//====================
+//  FILES
+//====================
+
+void Poke32 (uint8_t * p, uint32_t v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+void Poke64 (uint8_t * p, uint64_t v)
+{
+    Poke32(p, (uint32_t)v);
+    Poke32(p + 4, (uint32_t)(v >> 32));
+}
+
+uint64_t Peek64 (const uint8_t * p)
+{
+    uint64_t    v = 0;
+    int         i;
+
+    for (i=0 ; i<8 ; i++)
+        v |= (uint64_t)p[i] << (i * 8);
+    return v;
+}
+
+
+bool ReadFile (const char * filename, uint8_t ** out, size_t * outsize)
+{
+    FILE *  stream;
+    long    length;
+
+    stream = fopen(filename, "rb");
+    if (!stream)
+        return false;
+    fseek(stream, 0, SEEK_END);
+    length = ftell(stream);
+    fseek(stream, 0, SEEK_SET);
+    *out = malloc(length);
+    *outsize = length;
+    if (!*out || fread(*out, length, 1, stream) != 1) {
+        fclose(stream);
+        return false;
+    }
+    fclose(stream);
+    return true;
+}
+
+
+bool WriteFile (const char * filename, const uint8_t * p, size_t length)
+{
+    FILE *  stream;
+    bool    ok;
+
+    stream = fopen(filename, "wb");
+    if (!stream)
+        return false;
+    ok = fwrite(p, length, 1, stream) == 1;
+    if (fclose(stream) != 0)
+        ok = false;
+    return ok;
+}
+
+
+//
+// Record
+// The same sort of key mashing as sim.c, from a seed.
+//
+bool Record (uint64_t seed)
+{
+    replay_t        r;
+    game_state_t    g;
+    uint32_t        rng = (uint32_t)seed;
+    int             input;
+    bool            ok;
+
+    InitReplay(&r, seed, 0);
+    InitGame(&g, seed, 0);
+    while (!g.gameover && g.frame < MAX_FRAMES)
+    {
+        rng = rng * 1664525 + 1013904223;
+        input = (rng >> 16) % 8 == 0 ? 1 << ((rng >> 8) % 3) : 0;
+        if (!RecordInput(&r, g.frame, input))
+            return false;
+        StepGame(&g, input);
+    }
+    FinishReplay(&r, &g);
+
+    ok = WriteReplay(&r, CHECKFILE, KEYINTERVAL)
+        && ReadFile(CHECKFILE, &original, &originalsize);
+    FreeReplay(&r);
+    return ok;
+}
+
+
+
+//====================
+//  CASES
+//====================
+
+uint8_t * Trailer (void)
+{
+    return data + size - TRAILER_SIZE;
+}
+
+uint8_t * FirstKeyframe (void)
+{
+    return data + HEADER_SIZE;
+}
+
+
+void Unchanged (void)
+{
+}
+
+
+// an index offset that only adds up to the trailer once it wraps
+void WrapIndexOffset (void)
+{
+    uint32_t numkeyframes = 0x10000000;
+
+    Poke32(Trailer() + 8, numkeyframes);
+    Poke64(Trailer(), (uint64_t)(size - TRAILER_SIZE) - (uint64_t)numkeyframes * 12);
+}
+
+
+// an index that runs into the trailer
+void IndexPastTrailer (void)
+{
+    Poke64(Trailer(), Peek64(Trailer()) + 4);
+}
+
+
+// a keyframe offset that wraps past the index
+void WrapKeyframeOffset (void)
+{
+    Poke64(data + Peek64(Trailer()) + 4, UINT64_MAX - 10);
+}
+
+
+// keyframe 0 claims the game is already over with a big score, as
+// stored in the trailer
+void ForgeFirstKeyframe (void)
+{
+    uint8_t *   t = Trailer();
+    uint32_t    frames = t[16] | t[17] << 8 | t[18] << 16 | (uint32_t)t[19] << 24;
+
+    Poke32(FirstKeyframe(), frames);
+    Poke32(FirstKeyframe() + 4 + 6 + 32 + 2 + TET_COUNT + BOARD_H * BOARD_W + 8, 999999);
+    Poke32(t + 20, 999999);
+}
+
+
+// a waiting piece hanging off the right of the board
+void PieceOffBoard (void)
+{
+    FirstKeyframe()[4] = BOARD_W - 1;
+    FirstKeyframe()[8] |= 1; // spawn
+}
+
+
+typedef struct
+{
+    const char *    name;
+    void            (*change) (void);
+    bool            opens; // OpenReplay takes it
+    bool            plays; // PlayReplay verifies it
+    bool            seeks; // SeekReplay to the start works
+} case_t;
+
+case_t cases[] =
+{
+    { "unchanged",          Unchanged,          true,  true,  true },
+    { "wrapped index",      WrapIndexOffset,    false, false, false },
+    { "index past trailer", IndexPastTrailer,   false, false, false },
+    { "wrapped keyframe",   WrapKeyframeOffset, false, false, false },
+    { "forged keyframe 0",  ForgeFirstKeyframe, true,  false, true },
+    { "piece off board",    PieceOffBoard,      true,  true,  false },
+};
+
+#define NUMCASES    (int)(sizeof(cases) / sizeof(cases[0]))
+
+
+bool RunCase (const case_t * c)
+{
+    replayfile_t    f;
+    replaycursor_t  cursor;
+    game_state_t    g;
+    bool            opens, plays = false, seeks = false;
+
+    memcpy(data, original, size);
+    c->change();
+    if (!WriteFile(CHECKFILE, data, size)) {
+        printf("%-20s could not write %s\n", c->name, CHECKFILE);
+        return false;
+    }
+
+    opens = OpenReplay(&f, CHECKFILE);
+    if (opens) {
+        plays = PlayReplay(&f, &g);
+        seeks = SeekReplay(&f, 0, &g, &cursor);
+        CloseReplay(&f);
+    }
+
+    printf("%-20s open %d play %d seek %d", c->name, opens, plays, seeks);
+    if (opens != c->opens || plays != c->plays || seeks != c->seeks) {
+        printf("   expected %d %d %d\n", c->opens, c->plays, c->seeks);
+        return false;
+    }
+    printf("\n");
+    return true;
+}
+
+
+
+int CheckParm (int argc, const char * argv[], const char * parm)
+{
+    int i;
+
+    for (i=1 ; i<argc ; i++)
+        if (!strcmp(argv[i], parm))
+            return i;
+    return 0;
+}
+
+
+
+int main (int argc, const char * argv[])
+{
+    uint64_t    seed = 1;
+    int         i, p, failed = 0;
+
+    if ((p = CheckParm(argc, argv, "-seed")) && p < argc-1)
+        seed = strtoull(argv[p+1], NULL, 0);
+
+    if (!Record(seed)) {
+        printf("replaycheck: Error! Could not record a game\n");
+        return 1;
+    }
+    size = originalsize;
+    data = malloc(size);
+    if (!data)
+        return 1;
+
+    for (i=0 ; i<NUMCASES ; i++)
+        if (!RunCase(&cases[i]))
+            failed++;
+
+    remove(CHECKFILE);
+    free(data);
+    free(original);
+    if (failed)
+        printf("replaycheck: %d of %d cases failed\n", failed, NUMCASES);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,407 @@
+//
+//  scores.c
+//  tetris
+//
+//  The journal is little-endian:
+//
+//  header      "TSCJ", u16 version, u16 0
+//  records     RECORD_SIZE bytes each: u32 checksum of the rest of the
+//              record, i32 score, i32 level, u64 unix time, name padded
+//              with zeros to 12 bytes
+//
+//  Records are only ever added at the end. One torn by a crash either
+//  fails its checksum and is skipped, or is short and gets cut off the
+//  file so the next record lines up. A write that fails while the game
+//  is running is cut off the same way before anything else is added.
+//  A new journal, or one made from an old scores.dat, is written to a
+//  temporary file and renamed into place, so there is never one with
+//  half a header.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scores.h"
+
+#define HEADER_SIZE     8
+#define RECORD_SIZE     32
+#define LEGACY_SIZE     (TOP_SCORES * sizeof(score_t)) // scores.dat before the journal
+
+score_t         topscores[TOP_SCORES];
+int             numscores;
+int             badscores;
+
+// the writer thread and the records waiting for it
+pthread_t       writer;
+pthread_mutex_t queuelock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  queuewake = PTHREAD_COND_INITIALIZER;
+uint8_t *       queue;
+size_t          queued;
+size_t          queuemax;
+bool            closing;
+bool            writefailed;
+bool            running;
+int             journal = -1; // opened for appending
+
+
+
+#pragma mark - Records
+
+// FNV-1a
+uint32_t RecordChecksum (const uint8_t * p, size_t size)
+{
+    uint32_t hash = 2166136261u;
+
+    while (size--) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+void PutLE (uint8_t * p, uint64_t v, int size)
+{
+    int i;
+
+    for (i=0 ; i<size ; i++)
+        p[i] = (uint8_t)(v >> (i * 8));
+}
+
+uint64_t GetLE (const uint8_t * p, int size)
+{
+    uint64_t    v = 0;
+    int         i;
+
+    for (i=0 ; i<size ; i++)
+        v |= (uint64_t)p[i] << (i * 8);
+    return v;
+}
+
+
+void PackRecord (const score_t * s, uint64_t when, uint8_t * rec)
+{
+    memset(rec, 0, RECORD_SIZE);
+    PutLE(rec + 4, (uint32_t)s->score, 4);
+    PutLE(rec + 8, (uint32_t)s->level, 4);
+    PutLE(rec + 12, when, 8);
+    memcpy(rec + 20, s->name, strnlen(s->name, NAME_SIZE - 1));
+    PutLE(rec, RecordChecksum(rec + 4, RECORD_SIZE - 4), 4);
+}
+
+
+// returns false if the checksum is wrong
+bool UnpackRecord (const uint8_t * rec, score_t * s)
+{
+    if (GetLE(rec, 4) != RecordChecksum(rec + 4, RECORD_SIZE - 4))
+        return false;
+
+    memset(s, 0, sizeof(*s));
+    s->score = (int32_t)GetLE(rec + 4, 4);
+    s->level = (int32_t)GetLE(rec + 8, 4);
+    memcpy(s->name, rec + 20, NAME_SIZE - 1);
+    return true;
+}
+
+
+
+#pragma mark - Top Scores
+
+// where 'score' would go in the table, TOP_SCORES if it doesn't make it
+int ScoreRank (int score)
+{
+    int i;
+
+    for (i=0 ; i<TOP_SCORES ; i++)
+        if (score > topscores[i].score)
+            break;
+    return i;
+}
+
+
+// below any equal score already there, as the first to get it stays ahead
+void InsertScore (const score_t * s)
+{
+    int i = ScoreRank(s->score);
+
+    if (i == TOP_SCORES)
+        return;
+    memmove(&topscores[i + 1], &topscores[i], sizeof(score_t) * (TOP_SCORES - 1 - i));
+    topscores[i] = *s;
+}
+
+
+// one pass over every record
+void ReadJournal (const uint8_t * data, size_t size)
+{
+    const uint8_t * p;
+    score_t         s;
+
+    for (p=data+HEADER_SIZE ; p+RECORD_SIZE<=data+size ; p+=RECORD_SIZE)
+    {
+        if (!UnpackRecord(p, &s)) {
+            badscores++;
+            continue;
+        }
+        InsertScore(&s);
+        numscores++;
+    }
+}
+
+
+
+#pragma mark - Journal
+
+bool WriteAll (int fd, const uint8_t * p, size_t size)
+{
+    ssize_t n;
+
+    while (size)
+    {
+        n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+//
+// CreateJournal
+// Write a journal holding what's in topscores and swap it in for
+// whatever was at 'filename'.
+//
+bool CreateJournal (const char * filename)
+{
+    uint8_t     data[HEADER_SIZE + TOP_SCORES * RECORD_SIZE];
+    char        temp[1024];
+    size_t      size;
+    int         fd, i;
+    bool        ok;
+
+    memcpy(data, SCORES_MAGIC, 4);
+    PutLE(data + 4, SCORES_VERSION, 2);
+    PutLE(data + 6, 0, 2);
+    size = HEADER_SIZE;
+    for (i=0 ; i<TOP_SCORES && topscores[i].score ; i++, size+=RECORD_SIZE)
+        PackRecord(&topscores[i], 0, data + size);
+    numscores = i;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", filename);
+    fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return false;
+    ok = WriteAll(fd, data, size) && fsync(fd) == 0;
+    if (close(fd) != 0)
+        ok = false;
+    if (ok && rename(temp, filename) != 0)
+        ok = false;
+    if (!ok)
+        unlink(temp);
+    return ok;
+}
+
+
+//
+// WriterThread
+// Take whatever has been queued, append it, and fsync once for all of it.
+// A batch that fails is cut back off the file, as part of a record left
+// in the middle would put every record after it off line. If that can't
+// be done nothing more is appended.
+//
+void * WriterThread (void * arg)
+{
+    uint8_t *   batch = NULL;
+    uint8_t *   swap;
+    size_t      batchmax = 0;
+    size_t      size;
+    off_t       goodsize; // end of the last batch written whole
+    bool        stopped;
+    bool        ok;
+
+    (void)arg;
+    goodsize = lseek(journal, 0, SEEK_END);
+    stopped = goodsize == -1;
+
+    pthread_mutex_lock(&queuelock);
+    while (1)
+    {
+        while (!queued && !closing)
+            pthread_cond_wait(&queuewake, &queuelock);
+        if (!queued)
+            break; // closing and nothing left
+
+        swap = batch; batch = queue; queue = swap;
+        size = batchmax; batchmax = queuemax; queuemax = size;
+        size = queued;
+        queued = 0;
+        pthread_mutex_unlock(&queuelock);
+
+        ok = !stopped && WriteAll(journal, batch, size) && fsync(journal) == 0;
+        if (ok)
+            goodsize += size;
+        else if (!stopped && ftruncate(journal, goodsize) == -1)
+            stopped = true;
+
+        pthread_mutex_lock(&queuelock);
+        if (!ok)
+            writefailed = true;
+    }
+    pthread_mutex_unlock(&queuelock);
+
+    free(batch);
+    return NULL;
+}
+
+
+//
+// OpenScores
+// Fill topscores from the journal and start the writer. A scores.dat
+// from before the journal is turned into one. Returns false if there's
+// no journal to write to, scores are then only kept until the game quits.
+//
+bool OpenScores (const char * filename)
+{
+    struct stat     st;
+    uint8_t *       data;
+    bool            isjournal = false;
+    int             fd, i;
+
+    memset(topscores, 0, sizeof(topscores));
+    numscores = badscores = 0;
+
+    fd = open(filename, O_RDWR | O_APPEND);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            return false;
+        st.st_size = 0;
+    } else if (fstat(fd, &st) == -1) {
+        close(fd);
+        return false;
+    }
+
+    if (st.st_size > 0)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+
+        if (st.st_size >= HEADER_SIZE && !memcmp(data, SCORES_MAGIC, 4)
+            && GetLE(data + 4, 2) == SCORES_VERSION) {
+            ReadJournal(data, st.st_size);
+            isjournal = true;
+        } else if (st.st_size == LEGACY_SIZE) {
+            memcpy(topscores, data, LEGACY_SIZE);
+            for (i=0 ; i<TOP_SCORES ; i++)
+                topscores[i].name[NAME_SIZE - 1] = '\0';
+        } else {
+            munmap(data, st.st_size); // not ours, don't write over it
+            close(fd);
+            return false;
+        }
+        munmap(data, st.st_size);
+    }
+
+    if (isjournal)
+    {
+        // cut off a record a crash left short so the next one lines up
+        if ((st.st_size - HEADER_SIZE) % RECORD_SIZE
+            && ftruncate(fd, st.st_size - (st.st_size - HEADER_SIZE) % RECORD_SIZE) == -1) {
+            close(fd);
+            return false;
+        }
+        journal = fd;
+    }
+    else
+    {
+        if (fd != -1)
+            close(fd);
+        if (!CreateJournal(filename))
+            return false;
+        journal = open(filename, O_WRONLY | O_APPEND);
+        if (journal == -1)
+            return false;
+    }
+
+    if (pthread_create(&writer, NULL, WriterThread, NULL)) {
+        close(journal);
+        journal = -1;
+        return false;
+    }
+    running = true;
+    return true;
+}
+
+
+//
+// AddScore
+// Into topscores straight away, onto the disk in the background.
+//
+void AddScore (const score_t * s)
+{
+    uint8_t     rec[RECORD_SIZE];
+    uint8_t *   grown;
+
+    InsertScore(s);
+    numscores++;
+    if (!running)
+        return;
+
+    PackRecord(s, (uint64_t)time(NULL), rec);
+    pthread_mutex_lock(&queuelock);
+    if (queued + RECORD_SIZE > queuemax)
+    {
+        grown = realloc(queue, queuemax ? queuemax * 2 : 16 * RECORD_SIZE);
+        if (!grown) {
+            writefailed = true;
+            pthread_mutex_unlock(&queuelock);
+            return;
+        }
+        queue = grown;
+        queuemax = queuemax ? queuemax * 2 : 16 * RECORD_SIZE;
+    }
+    memcpy(queue + queued, rec, RECORD_SIZE);
+    queued += RECORD_SIZE;
+    pthread_cond_signal(&queuewake);
+    pthread_mutex_unlock(&queuelock);
+}
+
+
+//
+// CloseScores
+// Wait for anything still queued to be written. Returns false if any
+// score couldn't be saved.
+//
+bool CloseScores (void)
+{
+    if (!running)
+        return true;
+
+    pthread_mutex_lock(&queuelock);
+    closing = true;
+    pthread_cond_signal(&queuewake);
+    pthread_mutex_unlock(&queuelock);
+    pthread_join(writer, NULL);
+
+    close(journal);
+    journal = -1;
+    free(queue);
+    queue = NULL;
+    queued = queuemax = 0;
+    running = closing = false;
+    return !writefailed;
+}
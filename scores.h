@@ -0,0 +1,38 @@
+//
+//  scores.h
+//  tetris
+//
+//  High scores. Every score entered is appended to a journal on disk and
+//  never rewritten, the top ten are kept in memory from a single pass
+//  over it at startup. Writes happen on a background thread so the
+//  screen never waits on the disk.
+//
+
+#ifndef scores_h
+#define scores_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SCORES_MAGIC    "TSCJ"
+#define SCORES_VERSION  1
+#define NAME_SIZE       11
+#define TOP_SCORES      10
+
+typedef struct
+{
+    int         score;
+    int         level;
+    char        name[NAME_SIZE];
+} score_t;
+
+extern score_t  topscores[TOP_SCORES]; // best first, unused ones are all 0
+extern int      numscores; // good records in the journal
+extern int      badscores; // records skipped for a bad checksum
+
+bool OpenScores (const char * filename);
+int  ScoreRank (int score);
+void AddScore (const score_t * s);
+bool CloseScores (void);
+
+#endif /* scores_h */
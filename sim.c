@@ -0,0 +1,428 @@
+//
+//  sim.c
+//  tetris
+//
+//  Batch runner: plays many seeded games as fast as possible on a pool of
+//  worker threads, with no window, sound or frame delay, and prints
+//  aggregate statistics.
+//
+//  usage: sim [-games N] [-threads N] [-seed N] [-frames N] [-bot [-beam N]] [-bag] [-v]
+//
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "bot.h"
+#include "game.h"
+
+#define MAX_THREADS     256
+#define DEFAULT_GAMES   1000
+#define DEFAULT_FRAMES  1000000 // per game, in case a policy never tops out
+#define CACHE_LINE      64
+
+typedef struct
+{
+    int         score;
+    int         lines;
+    int         level;
+    int         pieces;
+    int         frames;
+    uint64_t    evaluated; // placements the bot scored
+    uint64_t    nodes;
+    uint64_t    probes, hits;
+    double      searchtime;
+} result_t;
+
+enum
+{
+    STAT_SCORE,
+    STAT_LINES,
+    STAT_LEVEL,
+    STAT_PIECES,
+    STAT_FRAMES,
+    NUMSTATS
+};
+
+const char * statnames[NUMSTATS] = { "score", "lines", "level", "pieces", "frames" };
+
+typedef struct
+{
+    int64_t     count;
+    double      sum[NUMSTATS];
+    double      sumsq[NUMSTATS];
+    int         min[NUMSTATS];
+    int         max[NUMSTATS];
+    uint64_t    evaluated;
+    uint64_t    nodes;
+    uint64_t    probes, hits;
+    double      searchtime; // summed over threads
+} totals_t;
+
+//
+// Each worker owns a range of game indices [next, end), packed into one
+// 64-bit word so the owner taking from the front and thieves splitting
+// off the back half can both use a single compare-and-swap.
+//
+typedef struct
+{
+    _Alignas(CACHE_LINE) _Atomic uint64_t range;
+    totals_t            totals; // only touched by the owner until joined
+    pthread_t           thread;
+    int                 id;
+} worker_t;
+
+worker_t    workers[MAX_THREADS];
+int         numworkers;
+
+result_t *  results;
+int         numgames;
+uint64_t    baseseed;
+int         maxframes;
+bool        usebot; // play with the autoplayer instead of mashing keys
+int         beamwidth = BOT_BEAM;
+int         gameflags; // GM_*
+bool        verbose;
+
+
+#define RANGE(next, end)    ((uint64_t)(end) << 32 | (uint32_t)(next))
+#define RANGE_NEXT(r)       ((uint32_t)(r))
+#define RANGE_END(r)        ((uint32_t)((r) >> 32))
+
+
+
+//====================
+//  INPUT POLICY
+//====================
+
+//
+// RandomInput
+// Stand-in player: mash the game keys at random, roughly as often as a
+// person would press them.
+//
+int RandomInput (rng_t * rng)
+{
+    uint64_t r = NextRandom(rng);
+    int input = 0;
+    int key = r % 100;
+
+    if (key < 6)
+        input |= IN_ROTATE;
+    else if (key < 14)
+        input |= IN_LEFT;
+    else if (key < 22)
+        input |= IN_RIGHT;
+    if ((r >> 32) % 100 < 2)
+        input |= IN_DROP;
+
+    return input;
+}
+
+
+
+//====================
+//  GAMES
+//====================
+
+void PlayGame (int index, result_t * res)
+{
+    game_state_t    g;
+    bot_t           bot;
+    rng_t           rng;
+    int             events;
+
+    // game i plays the same pieces whatever thread it lands on, and the
+    // key mashing is split off the game's generator so it can't line up
+    // with the pieces
+    InitGame(&g, baseseed + (uint64_t)index, gameflags);
+    rng = g.rng;
+    JumpRandom(&rng);
+    if (!InitBot(&bot, usebot ? beamwidth : 0)) {
+        fprintf(stderr, "sim: Error! Could not allocate the bot's search\n");
+        exit(1);
+    }
+
+    memset(res, 0, sizeof(*res));
+    while (!g.gameover && g.frame < maxframes)
+    {
+        events = StepGame(&g, usebot ? BotInput(&bot, &g) : RandomInput(&rng));
+        if (events & EV_SPAWN)
+            res->pieces++;
+    }
+
+    res->score = g.score;
+    res->lines = g.numlines;
+    res->level = g.level;
+    res->frames = g.frame;
+    res->evaluated = bot.evaluated;
+    res->nodes = bot.nodes;
+    res->probes = bot.probes;
+    res->hits = bot.hits;
+    res->searchtime = bot.seconds;
+    FreeBot(&bot);
+}
+
+
+
+void AddResult (totals_t * t, const result_t * res)
+{
+    int values[NUMSTATS] = {
+        res->score, res->lines, res->level, res->pieces, res->frames
+    };
+    int i;
+
+    for (i=0 ; i<NUMSTATS ; i++)
+    {
+        if (t->count == 0 || values[i] < t->min[i])
+            t->min[i] = values[i];
+        if (t->count == 0 || values[i] > t->max[i])
+            t->max[i] = values[i];
+        t->sum[i] += values[i];
+        t->sumsq[i] += (double)values[i] * values[i];
+    }
+    t->evaluated += res->evaluated;
+    t->nodes += res->nodes;
+    t->probes += res->probes;
+    t->hits += res->hits;
+    t->searchtime += res->searchtime;
+    t->count++;
+}
+
+
+
+void MergeTotals (totals_t * dst, const totals_t * src)
+{
+    int i;
+
+    if (src->count == 0)
+        return;
+
+    for (i=0 ; i<NUMSTATS ; i++)
+    {
+        if (dst->count == 0 || src->min[i] < dst->min[i])
+            dst->min[i] = src->min[i];
+        if (dst->count == 0 || src->max[i] > dst->max[i])
+            dst->max[i] = src->max[i];
+        dst->sum[i] += src->sum[i];
+        dst->sumsq[i] += src->sumsq[i];
+    }
+    dst->evaluated += src->evaluated;
+    dst->nodes += src->nodes;
+    dst->probes += src->probes;
+    dst->hits += src->hits;
+    dst->searchtime += src->searchtime;
+    dst->count += src->count;
+}
+
+
+
+#pragma mark - Work Stealing
+
+//
+// TakeGame
+// Pop the next index from the front of a worker's own range.
+// Returns -1 if the range is empty.
+//
+int TakeGame (worker_t * w)
+{
+    uint64_t r = atomic_load_explicit(&w->range, memory_order_relaxed);
+
+    while (RANGE_NEXT(r) < RANGE_END(r))
+    {
+        if (atomic_compare_exchange_weak_explicit(&w->range, &r,
+                RANGE(RANGE_NEXT(r) + 1, RANGE_END(r)),
+                memory_order_acquire, memory_order_relaxed))
+            return RANGE_NEXT(r);
+    }
+    return -1;
+}
+
+
+//
+// StealGames
+// Split the back half off another worker's range and make it ours.
+// Returns false if every other worker is out of games.
+//
+bool StealGames (worker_t * thief)
+{
+    worker_t *  victim;
+    uint64_t    r;
+    uint32_t    next, end, mid;
+    int         i;
+
+    for (i=1 ; i<numworkers ; i++)
+    {
+        victim = &workers[(thief->id + i) % numworkers];
+        r = atomic_load_explicit(&victim->range, memory_order_relaxed);
+
+        while ((next = RANGE_NEXT(r)) < (end = RANGE_END(r)))
+        {
+            mid = next + (end - next) / 2;
+            if (atomic_compare_exchange_weak_explicit(&victim->range, &r,
+                    RANGE(next, mid), memory_order_acquire, memory_order_relaxed))
+            {
+                atomic_store_explicit(&thief->range, RANGE(mid, end),
+                                      memory_order_release);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+void * WorkerThread (void * arg)
+{
+    worker_t *  w = arg;
+    int         index;
+
+    while (1)
+    {
+        while ((index = TakeGame(w)) != -1)
+        {
+            PlayGame(index, &results[index]);
+            AddResult(&w->totals, &results[index]);
+        }
+        if (!StealGames(w))
+            break;
+    }
+    return NULL;
+}
+
+
+
+#pragma mark -
+
+void PrintTotals (const totals_t * t, double seconds)
+{
+    double  mean, var;
+    int     i;
+
+    printf("%lld games on %d threads in %.3f s: %.1f games/s, %.0f frames/s\n",
+           (long long)t->count, numworkers, seconds,
+           t->count / seconds, t->sum[STAT_FRAMES] / seconds);
+    printf("%-8s %12s %12s %10s %10s\n", "", "mean", "stddev", "min", "max");
+    for (i=0 ; i<NUMSTATS ; i++)
+    {
+        mean = t->sum[i] / t->count;
+        var = t->sumsq[i] / t->count - mean * mean;
+        printf("%-8s %12.2f %12.2f %10d %10d\n", statnames[i], mean,
+               var > 0 ? sqrt(var) : 0.0, t->min[i], t->max[i]);
+    }
+
+    if (t->evaluated)
+        printf("bot: %llu placements evaluated, %.0f/s per thread searching, %.0f/s overall\n",
+               (unsigned long long)t->evaluated, t->evaluated / t->searchtime,
+               t->evaluated / seconds);
+    if (t->probes)
+        printf("bot: %llu nodes, %.0f/s per thread searching, %.1f%% transposition hits\n",
+               (unsigned long long)t->nodes, t->nodes / t->searchtime,
+               100.0 * t->hits / t->probes);
+}
+
+
+
+int CheckParm (int argc, const char * argv[], const char * parm)
+{
+    int i;
+
+    for (i=1 ; i<argc ; i++)
+        if (!strcmp(argv[i], parm))
+            return i;
+    return 0;
+}
+
+
+
+int main (int argc, const char * argv[])
+{
+    struct timespec start, end;
+    totals_t        totals;
+    double          seconds;
+    int             i, p;
+    int             first, last;
+
+    numgames = DEFAULT_GAMES;
+    numworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    baseseed = (uint64_t)time(NULL);
+    maxframes = DEFAULT_FRAMES;
+
+    if ((p = CheckParm(argc, argv, "-games")) && p < argc-1)
+        numgames = atoi(argv[p+1]);
+    if ((p = CheckParm(argc, argv, "-threads")) && p < argc-1)
+        numworkers = atoi(argv[p+1]);
+    if ((p = CheckParm(argc, argv, "-seed")) && p < argc-1)
+        baseseed = strtoull(argv[p+1], NULL, 0);
+    if ((p = CheckParm(argc, argv, "-frames")) && p < argc-1)
+        maxframes = atoi(argv[p+1]);
+    usebot = CheckParm(argc, argv, "-bot") != 0;
+    if ((p = CheckParm(argc, argv, "-beam")) && p < argc-1)
+        beamwidth = atoi(argv[p+1]);
+    gameflags = CheckParm(argc, argv, "-bag") ? GM_BAG : 0;
+    verbose = CheckParm(argc, argv, "-v") != 0;
+    ChooseBatchKernel(NULL);
+
+    if (numgames < 1)
+        numgames = 1;
+    if (numworkers < 1)
+        numworkers = 1;
+    if (numworkers > MAX_THREADS)
+        numworkers = MAX_THREADS;
+    if (numworkers > numgames)
+        numworkers = numgames;
+
+    results = calloc(numgames, sizeof(result_t));
+    if (!results) {
+        fprintf(stderr, "sim: Error! Could not allocate results\n");
+        return 1;
+    }
+
+    // shard the games evenly, stealing evens out the rest
+    for (i=0 ; i<numworkers ; i++)
+    {
+        first = (int)((int64_t)numgames * i / numworkers);
+        last = (int)((int64_t)numgames * (i + 1) / numworkers);
+        workers[i].id = i;
+        memset(&workers[i].totals, 0, sizeof(totals_t));
+        atomic_init(&workers[i].range, RANGE(first, last));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i=1 ; i<numworkers ; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, WorkerThread, &workers[i])) {
+            fprintf(stderr, "sim: Error! Could not create thread %d\n", i);
+            return 1;
+        }
+    }
+    WorkerThread(&workers[0]);
+    for (i=1 ; i<numworkers ; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    memset(&totals, 0, sizeof(totals));
+    for (i=0 ; i<numworkers ; i++)
+        MergeTotals(&totals, &workers[i].totals);
+
+    if (verbose)
+    {
+        for (i=0 ; i<numgames ; i++)
+            printf("game %d: score %d lines %d level %d pieces %d frames %d\n",
+                   i, results[i].score, results[i].lines, results[i].level,
+                   results[i].pieces, results[i].frames);
+    }
+    PrintTotals(&totals, seconds);
+
+    free(results);
+    return 0;
+}
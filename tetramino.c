@@ -5,116 +5,100 @@
 //  Created by Thomas Foster on 8/15/18.
 //
 
-#include <stdio.h>
-#include <string.h>
 #include "tetramino.h"
 
-char shapes[TET_COUNT][R_COUNT][DATA_SIZE][DATA_SIZE] =
-{
-	{ // O
-		{ {1,1,0,0},{1,1,0,0},{0,0,0,0},{0,0,0,0}, },
-		{ {1,1,0,0},{1,1,0,0},{0,0,0,0},{0,0,0,0}, },
-		{ {1,1,0,0},{1,1,0,0},{0,0,0,0},{0,0,0,0}, },
-		{ {1,1,0,0},{1,1,0,0},{0,0,0,0},{0,0,0,0}, },
-	},
-	{ // I
-		{ {0,0,0,0},{2,2,2,2},{0,0,0,0},{0,0,0,0}, },
-		{ {0,0,2,0},{0,0,2,0},{0,0,2,0},{0,0,2,0}, },
-		{ {0,0,0,0},{2,2,2,2},{0,0,0,0},{0,0,0,0}, },
-		{ {0,0,2,0},{0,0,2,0},{0,0,2,0},{0,0,2,0}, },
-	},
-	{ // L
-		{ {0,0,0,0},{3,3,3,0},{3,0,0,0},{0,0,0,0}, },
-		{ {0,3,0,0},{0,3,0,0},{0,3,3,0},{0,0,0,0}, },
-		{ {0,0,0,0},{0,0,3,0},{3,3,3,0},{0,0,0,0}, },
-		{ {3,3,0,0},{0,3,0,0},{0,3,0,0},{0,0,0,0}, },
-	},
-	{ // J
-		{ {0,0,0,0},{4,4,4,0},{0,0,4,0},{0,0,0,0}, },
-		{ {0,4,4,0},{0,4,0,0},{0,4,0,0},{0,0,0,0}, },
-		{ {0,0,0,0},{4,0,0,0},{4,4,4,0},{0,0,0,0}, },
-		{ {0,4,0,0},{0,4,0,0},{4,4,0,0},{0,0,0,0}, },
-	},
-	{ // S
-		{ {0,0,0,0},{0,5,5,0},{5,5,0,0},{0,0,0,0}, },
-		{ {0,5,0,0},{0,5,5,0},{0,0,5,0},{0,0,0,0}, },
-		{ {0,0,0,0},{0,5,5,0},{5,5,0,0},{0,0,0,0}, },
-		{ {0,5,0,0},{0,5,5,0},{0,0,5,0},{0,0,0,0}, },
-	},
-	{ // Z
-		{ {0,0,0,0},{6,6,0,0},{0,6,6,0},{0,0,0,0}, },
-		{ {0,0,6,0},{0,6,6,0},{0,6,0,0},{0,0,0,0}, },
-		{ {0,0,0,0},{6,6,0,0},{0,6,6,0},{0,0,0,0}, },
-		{ {0,0,6,0},{0,6,6,0},{0,6,0,0},{0,0,0,0}, },
-	},
-	{ // T
-		{ {0,0,0,0},{7,7,7,0},{0,7,0,0},{0,0,0,0}, },
-		{ {0,7,0,0},{0,7,7,0},{0,7,0,0},{0,0,0,0}, },
-		{ {0,0,0,0},{0,7,0,0},{7,7,7,0},{0,0,0,0}, },
-		{ {0,7,0,0},{7,7,0,0},{0,7,0,0},{0,0,0,0}, },
-	},
-};
+//
+// Each rotation is written as the (x, y) of its four blocks within the
+// 4 * 4 grid. The macros below derive the rest of piece_t from those, so
+// the whole table is a constant expression and needs no init at startup.
+//
+
+#define MIN2(a, b)  ((a) < (b) ? (a) : (b))
+#define MAX2(a, b)  ((a) > (b) ? (a) : (b))
+#define MIN4(a, b, c, d)    MIN2(MIN2(a, b), MIN2(c, d))
+#define MAX4(a, b, c, d)    MAX2(MAX2(a, b), MAX2(c, d))
+
+// bits of row 'r'
+#define ROWMASK(r, x0,y0, x1,y1, x2,y2, x3,y3) \
+    ( ((y0)==(r)) << (x0) | ((y1)==(r)) << (x1) \
+    | ((y2)==(r)) << (x2) | ((y3)==(r)) << (x3) )
+
+// lowest block in column 'c', or -1
+#define LOWEST(c, x0,y0, x1,y1, x2,y2, x3,y3) \
+    MAX4( (x0)==(c) ? (y0) : -1, (x1)==(c) ? (y1) : -1, \
+          (x2)==(c) ? (y2) : -1, (x3)==(c) ? (y3) : -1 )
 
-char displayshapes[TET_COUNT][DATA_SIZE][DATA_SIZE] =
+#define PIECE(sx,sy, ...) \
+{ \
+    .cells = { CELLS(__VA_ARGS__) }, \
+    .masks = { \
+        ROWMASK(0, __VA_ARGS__), ROWMASK(1, __VA_ARGS__), \
+        ROWMASK(2, __VA_ARGS__), ROWMASK(3, __VA_ARGS__) }, \
+    .minx = XS(MIN4, __VA_ARGS__), .miny = YS(MIN4, __VA_ARGS__), \
+    .maxx = XS(MAX4, __VA_ARGS__), .maxy = YS(MAX4, __VA_ARGS__), \
+    .guide = { \
+        LOWEST(0, __VA_ARGS__), LOWEST(1, __VA_ARGS__), \
+        LOWEST(2, __VA_ARGS__), LOWEST(3, __VA_ARGS__) }, \
+    .spawnx = sx, .spawny = sy \
+}
+
+#define CELLS(x0,y0, x1,y1, x2,y2, x3,y3) {x0,y0}, {x1,y1}, {x2,y2}, {x3,y3}
+#define XS(f, x0,y0, x1,y1, x2,y2, x3,y3) f(x0, x1, x2, x3)
+#define YS(f, x0,y0, x1,y1, x2,y2, x3,y3) f(y0, y1, y2, y3)
+
+const piece_t pieces[TET_COUNT][R_COUNT] =
 {
-	{
-		{0,1,1,0},
-		{0,1,1,0},
-		{0,0,0,0},
-		{0,0,0,0}
-	}, {
-		{1,1,1,1},
-		{0,0,0,0},
-		{0,0,0,0},
-		{0,0,0,0},
-	}, {
-		{0,1,1,1},
-		{0,1,0,0},
-		{0,0,0,0},
-		{0,0,0,0},
-	}, {
-		{0,1,1,1},
-		{0,0,0,1},
-		{0,0,0,0},
-		{0,0,0,0},
-	}, {
-		{0,0,1,1},
-		{0,1,1,0},
-		{0,0,0,0},
-		{0,0,0,0},
-	}, {
-		{0,1,1,0},
-		{0,0,1,1},
-		{0,0,0,0},
-		{0,0,0,0},
-	}, {
-		{0,1,1,1},
-		{0,0,1,0},
-		{0,0,0,0},
-		{0,0,0,0},
-	},
+    { // O
+        PIECE( 3,1,  0,0, 1,0, 0,1, 1,1 ),
+        PIECE( 3,1,  0,0, 1,0, 0,1, 1,1 ),
+        PIECE( 3,1,  0,0, 1,0, 0,1, 1,1 ),
+        PIECE( 3,1,  0,0, 1,0, 0,1, 1,1 ),
+    },
+    { // I
+        PIECE( 3,0,  0,1, 1,1, 2,1, 3,1 ),
+        PIECE( 3,0,  2,0, 2,1, 2,2, 2,3 ),
+        PIECE( 3,0,  0,1, 1,1, 2,1, 3,1 ),
+        PIECE( 3,0,  2,0, 2,1, 2,2, 2,3 ),
+    },
+    { // L
+        PIECE( 3,0,  0,1, 1,1, 2,1, 0,2 ),
+        PIECE( 3,0,  1,0, 1,1, 1,2, 2,2 ),
+        PIECE( 3,0,  2,1, 0,2, 1,2, 2,2 ),
+        PIECE( 3,0,  0,0, 1,0, 1,1, 1,2 ),
+    },
+    { // J
+        PIECE( 3,0,  0,1, 1,1, 2,1, 2,2 ),
+        PIECE( 3,0,  1,0, 2,0, 1,1, 1,2 ),
+        PIECE( 3,0,  0,1, 0,2, 1,2, 2,2 ),
+        PIECE( 3,0,  1,0, 1,1, 0,2, 1,2 ),
+    },
+    { // S
+        PIECE( 3,0,  1,1, 2,1, 0,2, 1,2 ),
+        PIECE( 3,0,  1,0, 1,1, 2,1, 2,2 ),
+        PIECE( 3,0,  1,1, 2,1, 0,2, 1,2 ),
+        PIECE( 3,0,  1,0, 1,1, 2,1, 2,2 ),
+    },
+    { // Z
+        PIECE( 3,0,  0,1, 1,1, 1,2, 2,2 ),
+        PIECE( 3,0,  2,0, 1,1, 2,1, 1,2 ),
+        PIECE( 3,0,  0,1, 1,1, 1,2, 2,2 ),
+        PIECE( 3,0,  2,0, 1,1, 2,1, 1,2 ),
+    },
+    { // T
+        PIECE( 3,0,  0,1, 1,1, 2,1, 1,2 ),
+        PIECE( 3,0,  1,0, 1,1, 2,1, 1,2 ),
+        PIECE( 3,0,  1,1, 0,2, 1,2, 2,2 ),
+        PIECE( 3,0,  1,0, 0,1, 1,1, 1,2 ),
+    },
 };
 
-char guidedata[TET_COUNT][R_COUNT][4];
-
-// create the look-up table for drop guide positions
-void InitDropGuides (void)
+const cell_t displaycells[TET_COUNT][4] =
 {
-    int t, r, x, y;
-    
-    memset(guidedata, -1, sizeof(guidedata));
-    
-    for (t=0 ; t<TET_COUNT ; t++) {
-        for (r=0 ; r<R_COUNT ; r++)
-        {
-            for (x=0 ; x<DATA_SIZE ; x++) {
-                for (y=0 ; y<DATA_SIZE; y++)
-                {
-                    if (shapes[t][r][y][x]) {
-                        guidedata[t][r][x] = y;
-                    }
-                }
-            }
-        }
-    }
-}
+    { {1,0}, {2,0}, {1,1}, {2,1} }, // O
+    { {0,0}, {1,0}, {2,0}, {3,0} }, // I
+    { {1,0}, {2,0}, {3,0}, {1,1} }, // L
+    { {1,0}, {2,0}, {3,0}, {3,1} }, // J
+    { {2,0}, {3,0}, {1,1}, {2,1} }, // S
+    { {1,0}, {2,0}, {2,1}, {3,1} }, // Z
+    { {1,0}, {2,0}, {3,0}, {2,1} }, // T
+};
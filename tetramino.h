@@ -10,6 +10,7 @@
 #define tetramino_h
 
 #include <stdbool.h>
+#include <stdint.h>
 
 // tetramino shape data stored in a 4 * 4 grid
 #define DATA_SIZE   4
@@ -48,16 +49,26 @@ typedef struct
     bool        slide;
 } tetramino_t;
 
-extern char shapes[TET_COUNT][R_COUNT][DATA_SIZE][DATA_SIZE];
+typedef struct
+{
+    int8_t      x, y;
+} cell_t;
 
-// shapes displayed in the 'next' panel
-extern char displayshapes[TET_COUNT][DATA_SIZE][DATA_SIZE];
+// everything about one rotation of one type that used to be found by
+// scanning its 4 * 4 grid, built at compile time in tetramino.c
+typedef struct
+{
+    cell_t      cells[4];           // block offsets within the 4 * 4 grid
+    uint16_t    masks[DATA_SIZE];   // for each row, bit x set if column x
+    int8_t      minx, miny;         // bounding box of 'cells'
+    int8_t      maxx, maxy;
+    int8_t      guide[DATA_SIZE];   // lowest y in each column, -1 if none
+    int8_t      spawnx, spawny;     // where the piece enters the board
+} piece_t;
 
-// data for drawing the tetramino drop guide
-// for each rotation of each type, four values that represent the lowest y
-// that has a block in each column, or -1 if no blocks in that column
-extern char guidedata[TET_COUNT][R_COUNT][4];
+extern const piece_t pieces[TET_COUNT][R_COUNT];
 
-void InitDropGuides (void);
+// shapes displayed in the 'next' panel
+extern const cell_t displaycells[TET_COUNT][4];
 
 #endif /* tetramino_h */
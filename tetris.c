@@ -16,7 +16,12 @@
 #include <SDL2_image/SDL_image.h>
 #include <SDL2_mixer/SDL_mixer.h>
 
-#include "tetramino.h"
+#include "bot.h"
+#include "game.h"
+#include "profile.h"
+#include "replay.h"
+#include "embedded.h"
+#include "scores.h"
 
 #define DRAW_SCALE      3
 #define WINDOW_W        224
@@ -24,16 +29,10 @@
 
 #define FONT_W          8
 #define FONT_H          8
-#define BOARD_W         10
-#define BOARD_H         21 // visible area is 20 tall
 #define TILE_SIZE       8
-#define MS_PER_FRAME    16
-
-#define INITIAL_LVL     0
-#define LINES_PER_LVL   10
-#define INITIAL_CYCLE   60
-#define CYCLE_DECR      5   // cycle time 5 less each level
-#define SLIDE_TIME      30
+#define TICRATE         60 // game steps per second
+#define MAX_CATCHUP     8  // most steps run at once after a stall
+#define SPIN_MS         2
 
 enum
 {
@@ -42,47 +41,52 @@ enum
     GS_GAMEOVER
 } gamestate;
 
-enum
-{
-    PS_DROP,
-    PS_SLIDE,
-    PS_LINEFADE,
-} playstate;
-
 SDL_Window *    window;
 SDL_Renderer *  renderer;
 SDL_Texture *   font;
+SDL_Surface *   fontsurface; // RGBA copy of the font, see MakeText
 int             rows, cols; // console size
 int             csrx, csry; // cursor location
 
-tetramino_t     tet; // player-controlled tetramino
-tettype_t       nexttet;
-int             board[BOARD_H][BOARD_W]; // -1 unoccupied, >= 0 tettype_t
-bool            completed[BOARD_H]; // list of completed lines
+game_state_t    game;
 
-int             score;
-int             level;
-int             numlines;
-int             stats[TET_COUNT];
+bool            flatstyle = true;
 
-int             cyclelength;
-int             cycletimer; // i.e. game speed, in frames
-int             fadetimer;
-int             slidetimer;
+bool            vsync; // -vsync
+int             drawrate; // frames drawn per second, -fps
+int             das = 10; // steps a side key is held before it repeats, -das
+int             arr = 2; // steps between repeats, -arr
 
-bool            flatstyle = true;
+replay_t        recording; // -record
+const char *    recordfile;
+replayfile_t    playback; // -play
+replaycursor_t  playcursor;
+int             seekframe; // -seek
+bool            playing;
 
-#define NAME_SIZE   11
+int             gameflags; // GM_*, -bag
+bool            autoplay; // -autoplay, the bot plays
+bot_t           bot;
 
-typedef struct
-{
-    int score;
-    int level;
-    char name[NAME_SIZE];
-} score_t;
+bool            headless; // -headless, see HeadlessLoop
+SDL_Surface *   screen; // what a headless renderer draws to
+bool            reference; // -reference, everything drawn in full the slow way
+
+#ifdef PROFILE
+bool            profoverlay; // frame stats in the corner, F key
+#endif
+
+SDL_Texture *   staticlayer; // background and panel chrome, see UpdateStatic
+bool            staticvalid;
+SDL_Texture *   tileatlas; // every tile type in both styles, see BakeTileAtlas
+bool            atlasvalid;
+SDL_Texture *   framelayer; // the whole screen, see DrawAll
+SDL_Texture *   guidebeam; // drop guide gradient, see BakeDropGuide
+bool            guidevalid;
+
+#define SCORES_FILE "scores.dat" // see scores.c
 
 score_t blank = { 0, 0, "-"};
-score_t scores[10];
 
 
 //====================
@@ -151,34 +155,22 @@ InitPanel
 //  RANDOM NUMBER GENERATOR
 //====================
 
-unsigned char rndtable[256] = {
-    0,   8, 109, 220, 222, 241, 149, 107,  75, 248, 254, 140,  16,  66 ,
-    74,  21, 211,  47,  80, 242, 154,  27, 205, 128, 161,  89,  77,  36 ,
-    95, 110,  85,  48, 212, 140, 211, 249,  22,  79, 200,  50,  28, 188 ,
-    52, 140, 202, 120,  68, 145,  62,  70, 184, 190,  91, 197, 152, 224 ,
-    149, 104,  25, 178, 252, 182, 202, 182, 141, 197,   4,  81, 181, 242 ,
-    145,  42,  39, 227, 156, 198, 225, 193, 219,  93, 122, 175, 249,   0 ,
-    175, 143,  70, 239,  46, 246, 163,  53, 163, 109, 168, 135,   2, 235 ,
-    25,  92,  20, 145, 138,  77,  69, 166,  78, 176, 173, 212, 166, 113 ,
-    94, 161,  41,  50, 239,  49, 111, 164,  70,  60,   2,  37, 171,  75 ,
-    136, 156,  11,  56,  42, 146, 138, 229,  73, 146,  77,  61,  98, 196 ,
-    135, 106,  63, 197, 195,  86,  96, 203, 113, 101, 170, 247, 181, 113 ,
-    80, 250, 108,   7, 255, 237, 129, 226,  79, 107, 112, 166, 103, 241 ,
-    24, 223, 239, 120, 198,  58,  60,  82, 128,   3, 184,  66, 143, 224 ,
-    145, 224,  81, 206, 163,  45,  63,  90, 168, 114,  59,  33, 159,  95 ,
-    28, 139, 123,  98, 125, 196,  15,  70, 194, 253,  54,  14, 109, 226 ,
-    71,  17, 161,  93, 186,  87, 244, 138,  20,  52, 123, 251,  26,  36 ,
-    17,  46,  52, 231, 232,  76,  31, 221,  84,  37, 216, 165, 212, 106 ,
-    197, 242,  98,  43,  39, 175, 254, 145, 190,  84, 118, 222, 187, 136 ,
-    120, 163, 236, 249
-};
-
-int rndindex;
+// effects only, the game draws its pieces from its own generator so
+// nothing drawn can change them
+rng_t fxrng;
 
 int Random (void)
 {
-    rndindex = (rndindex + 1) & 0xff;
-    return rndtable[rndindex];
+    return RandomRange(&fxrng, 256);
+}
+
+
+// a fresh seed for each game
+uint64_t NewSeed (void)
+{
+    uint64_t x = (uint64_t)time(NULL) << 32 ^ SDL_GetPerformanceCounter();
+
+    return SplitMix64(&x);
 }
 
 
@@ -200,21 +192,303 @@ typedef enum
 } sount_t;
 
 Mix_Chunk * sounds[NUMSOUNDS];
+bool        audioopen;
+bool        audiofailed;
 
-void PlaySound (sount_t s)
+const char * soundfiles[NUMSOUNDS] =
 {
-    if (options[OPT_SOUND])
-        Mix_PlayChannel(1, sounds[s], 0);
+    "deet.wav",
+    "line.wav",
+    "tetris.wav",
+    "rotate.wav",
+    "level.wav",
+    "drop.wav",
+};
+
+
+
+//====================
+//  STARTUP
+//====================
+
+//
+// The font and sounds are built into the program (embedded.h), so by
+// default nothing is read or decoded. With -assets dir they come from
+// that directory instead, read and decoded on threads of their own while
+// SDL and the window come up. The loaders don't touch the renderer or
+// the mixer: the main thread makes the font texture once the window is
+// there, and the sounds are only made when the first one is played,
+// which is also when the audio device is opened.
+//
+
+#define MAX_STAGES      16
+
+typedef struct
+{
+    const char *    name; // file in the -assets directory
+    bool            image; // decode it, otherwise just read the file
+    SDL_Thread *    thread;
+    void *          data;
+    size_t          size;
+    SDL_Surface *   surface;
+    SDL_Surface *   rgba; // image converted to RGBA32
+    Uint64          start, end;
+} asset_t;
+
+enum
+{
+    ASSET_FONT,
+    ASSET_SOUNDS, // one per sount_t
+    NUMASSETS = ASSET_SOUNDS + NUMSOUNDS
+};
+
+asset_t         assets[NUMASSETS];
+const char *    assetdir; // -assets, NULL for the built-in ones
+
+// -startup, how long it took to get the first frame up
+typedef struct
+{
+    const char *    name;
+    Uint64          time;
+} stage_t;
+
+stage_t         stages[MAX_STAGES];
+int             numstages;
+Uint64          launchtime; // main was entered
+bool            showstartup;
+bool            started; // first frame presented
+
+
+int LoadAsset (void * data)
+{
+    asset_t *   a = data;
+    char        path[1024];
+    
+    a->start = SDL_GetPerformanceCounter();
+    snprintf(path, sizeof(path), "%s/%s", assetdir, a->name);
+    if (a->image) {
+        a->surface = IMG_Load(path);
+        if (a->surface)
+            a->rgba = SDL_ConvertSurfaceFormat(a->surface, SDL_PIXELFORMAT_RGBA32, 0);
+    } else {
+        a->data = SDL_LoadFile(path, &a->size);
+    }
+    a->end = SDL_GetPerformanceCounter();
+    return 0;
+}
+
+
+void StartAssets (bool sound)
+{
+    int i;
+    
+    assets[ASSET_FONT].name = "cgafont.png";
+    assets[ASSET_FONT].image = true;
+    for (i=0 ; i<NUMSOUNDS ; i++)
+        assets[ASSET_SOUNDS + i].name = soundfiles[i];
+    
+    if (!assetdir)
+        return; // built in
+    for (i=0 ; i<(sound ? NUMASSETS : ASSET_SOUNDS) ; i++)
+    {
+        assets[i].thread = SDL_CreateThread(LoadAsset, "asset", &assets[i]);
+        if (!assets[i].thread)
+            LoadAsset(&assets[i]); // no thread, do it now
+    }
+}
+
+
+asset_t * WaitAsset (int i)
+{
+    if (assets[i].thread) {
+        SDL_WaitThread(assets[i].thread, NULL);
+        assets[i].thread = NULL;
+    }
+    return &assets[i];
+}
+
+
+void FreeAssets (void)
+{
+    int i;
+    
+    for (i=0 ; i<NUMASSETS ; i++)
+    {
+        WaitAsset(i);
+        SDL_free(assets[i].data);
+        SDL_FreeSurface(assets[i].surface);
+        SDL_FreeSurface(assets[i].rgba);
+    }
+    memset(assets, 0, sizeof(assets));
+}
+
+
+//
+// UnpackFont
+// The built-in font into an RGBA32 surface, set bits in the font's
+// colour and the rest transparent.
+//
+asset_t * UnpackFont (void)
+{
+    asset_t *   a = &assets[ASSET_FONT];
+    Uint32 *    pixel;
+    Uint32      color;
+    int         rowbytes = (embedfontw + 7) / 8;
+    int         x, y;
+    
+    a->start = SDL_GetPerformanceCounter();
+    a->rgba = SDL_CreateRGBSurfaceWithFormat(0, embedfontw, embedfonth, 32, SDL_PIXELFORMAT_RGBA32);
+    if (a->rgba)
+    {
+        color = SDL_MapRGBA(a->rgba->format, embedfontcolor >> 16,
+                            embedfontcolor >> 8 & 0xff, embedfontcolor & 0xff, 255);
+        for (y=0 ; y<embedfonth ; y++)
+        {
+            pixel = (Uint32 *)((Uint8 *)a->rgba->pixels + y * a->rgba->pitch);
+            for (x=0 ; x<embedfontw ; x++)
+                pixel[x] = embedfont[y * rowbytes + x / 8] & 0x80 >> (x % 8) ? color : 0;
+        }
+    }
+    a->end = SDL_GetPerformanceCounter();
+    return a;
+}
+
+
+void MarkStage (const char * name)
+{
+    if (numstages < MAX_STAGES) {
+        stages[numstages].name = name;
+        stages[numstages].time = SDL_GetPerformanceCounter();
+        numstages++;
+    }
+}
+
+
+double SinceLaunch (Uint64 time)
+{
+    return (double)(time - launchtime) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+
+void ReportStartup (void)
+{
+    double  last = 0;
+    int     i;
+    
+    printf("startup: first frame at %.1f ms\n", SinceLaunch(stages[numstages-1].time));
+    for (i=0 ; i<numstages ; i++)
+    {
+        printf("  %-16s %7.1f ms   at %7.1f\n", stages[i].name,
+               SinceLaunch(stages[i].time) - last, SinceLaunch(stages[i].time));
+        last = SinceLaunch(stages[i].time);
+    }
+    for (i=0 ; i<NUMASSETS ; i++)
+        if (assets[i].end)
+            printf("  %-22s loaded from %.1f to %.1f ms\n", assets[i].name,
+                   SinceLaunch(assets[i].start), SinceLaunch(assets[i].end));
 }
 
-void InitSounds (void)
+
+
+#pragma mark - Sound
+
+//
+// EmbeddedSound
+// The built-in sound, played straight from the program if the mixer got
+// the format it was asked for, otherwise from a converted copy.
+//
+Mix_Chunk * EmbeddedSound (const char * name, int freq, Uint16 format, int channels)
+{
+    const embedsound_t *    e = NULL;
+    SDL_AudioCVT            cvt;
+    Mix_Chunk *             chunk;
+    int                     i;
+    
+    for (i=0 ; i<numembedsounds ; i++)
+        if (!strcmp(embedsounds[i].name, name))
+            e = &embedsounds[i];
+    if (!e)
+        return NULL;
+    
+    if (freq == EMBED_FREQUENCY && format == AUDIO_S16SYS && channels == EMBED_CHANNELS)
+        return Mix_QuickLoad_RAW((Uint8 *)e->data, e->size); // only ever read
+    
+    if (SDL_BuildAudioCVT(&cvt, AUDIO_S16SYS, EMBED_CHANNELS, EMBED_FREQUENCY,
+                          format, channels, freq) < 0)
+        return NULL;
+    cvt.len = e->size;
+    cvt.buf = SDL_malloc((size_t)e->size * cvt.len_mult);
+    if (!cvt.buf)
+        return NULL;
+    memcpy(cvt.buf, e->data, e->size);
+    if (SDL_ConvertAudio(&cvt) != 0 || !(chunk = Mix_QuickLoad_RAW(cvt.buf, cvt.len_cvt))) {
+        SDL_free(cvt.buf);
+        return NULL;
+    }
+    chunk->allocated = 1; // Mix_FreeChunk frees the copy
+    return chunk;
+}
+
+
+//
+// StartAudio
+// Open the audio device and make the sounds from what was loaded.
+// Returns false if there's no audio.
+//
+bool StartAudio (void)
+{
+    asset_t *   a;
+    Uint64      start;
+    Uint16      format;
+    int         freq, channels;
+    int         i;
+    
+    if (audioopen || audiofailed)
+        return audioopen;
+    
+    start = SDL_GetPerformanceCounter();
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+        audiofailed = true;
+        return false;
+    }
+    if (Mix_OpenAudio(EMBED_FREQUENCY,AUDIO_S16SYS,EMBED_CHANNELS,512) != 0) {
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        audiofailed = true;
+        return false;
+    }
+    if (!Mix_QuerySpec(&freq, &format, &channels)) { // open but unusable
+        Mix_CloseAudio();
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        audiofailed = true;
+        return false;
+    }
+    Mix_Volume(-1, 8);
+    
+    for (i=0 ; i<NUMSOUNDS ; i++)
+    {
+        a = WaitAsset(ASSET_SOUNDS + i);
+        if (assetdir) {
+            if (a->data)
+                sounds[i] = Mix_LoadWAV_RW(SDL_RWFromConstMem(a->data, (int)a->size), 1);
+        } else {
+            sounds[i] = EmbeddedSound(soundfiles[i], freq, format, channels);
+        }
+        SDL_free(a->data);
+        a->data = NULL;
+    }
+    
+    audioopen = true;
+    if (showstartup)
+        printf("startup: audio opened for the first sound in %.1f ms\n",
+               (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency());
+    return true;
+}
+
+
+void PlaySound (sount_t s)
 {
-    sounds[ SND_MOVE ]      = Mix_LoadWAV( "assets/deet.wav" );
-    sounds[ SND_LINE ]      = Mix_LoadWAV( "assets/line.wav" );
-    sounds[ SND_TETRIS ]    = Mix_LoadWAV( "assets/tetris.wav" );
-    sounds[ SND_ROTATE ]    = Mix_LoadWAV( "assets/rotate.wav" );
-    sounds[ SND_LEVELUP ]   = Mix_LoadWAV( "assets/level.wav" );
-    sounds[ SND_DROP ]      = Mix_LoadWAV( "assets/drop.wav" );
+    if (options[OPT_SOUND] && StartAudio())
+        Mix_PlayChannel(1, sounds[s], 0);
 }
 
 
@@ -298,20 +572,74 @@ void SetColor (SDL_Color * c)
 }
 
 
+float targetscalex, targetscaley;
+
+//
+//  BeginTarget / EndTarget
+//  Draw into a texture at 1:1, in window coords, then go back to
+//  drawing to the window at its usual scale.
+//
+void BeginTarget (SDL_Texture * texture)
+{
+    SDL_RenderGetScale(renderer, &targetscalex, &targetscaley);
+    SDL_SetRenderTarget(renderer, texture);
+    SDL_RenderSetScale(renderer, 1, 1);
+    SDL_RenderSetViewport(renderer, NULL);
+}
+
+void EndTarget (void)
+{
+    SDL_SetRenderTarget(renderer, NULL);
+    SDL_RenderSetScale(renderer, targetscalex, targetscaley);
+    SDL_RenderSetViewport(renderer, NULL);
+}
+
+
 
 
+void FlushTextCache (void);
+void ReportLatency (void);
+void SaveRecording (void);
+
 void Quit (const char * error)
 {
     int i;
     
+    SDL_DestroyTexture(staticlayer);
+    SDL_DestroyTexture(tileatlas);
+    SDL_DestroyTexture(framelayer);
+    SDL_DestroyTexture(guidebeam);
+    FlushTextCache();
+    SDL_FreeSurface(fontsurface);
     SDL_DestroyTexture(font);
     for (i=0 ; i<NUMSOUNDS ; i++)
         Mix_FreeChunk(sounds[i]);
-    Mix_CloseAudio();
+    if (audioopen)
+        Mix_CloseAudio();
+    FreeAssets();
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
+    SDL_FreeSurface(screen);
     SDL_Quit();
     
+    SaveRecording();
+    ReportLatency();
+    if (!CloseScores())
+        printf("Error! Could not save high scores to %s. Sorry!\n", SCORES_FILE);
+    if (bot.evaluated)
+    {
+        printf("autoplay: %llu placements evaluated, %.0f/s\n",
+               (unsigned long long)bot.evaluated, bot.evaluated / bot.seconds);
+        if (bot.probes)
+            printf("autoplay: %.0f nodes/s, %.1f%% transposition hits\n",
+                   bot.nodes / bot.seconds, 100.0 * bot.hits / bot.probes);
+    }
+    FreeBot(&bot);
+#ifdef PROFILE
+    if (ProfWriteTrace("trace.json"))
+        printf("profile written to trace.json\n");
+#endif
+    
     if (error && *error) {
         printf("Error! %s: %s\n", error, SDL_GetError());
         exit(1);
@@ -325,59 +653,86 @@ void Quit (const char * error)
 
 //
 //  Initialize
-//  Init SDL2, window, renderer, sound, console, and panels
+//  Init SDL2, window, renderer, console, and panels, with the assets
+//  loading alongside. Sound starts with the first one played.
 //
 void Initialize (void)
 {
-    SDL_Surface * s;
+    asset_t * fontasset;
+    SDL_DisplayMode mode;
     int w = WINDOW_W * DRAW_SCALE;
     int h = WINDOW_H * DRAW_SCALE;
     
-    rndindex = time(NULL) % 256;
+    StartAssets(!headless); // loads while the window comes up
     
-    // init window
-    if (SDL_Init(SDL_INIT_VIDEO|SDL_INIT_AUDIO) != 0)
-        Quit("main: Error! SDL_Init failed");
-    
-    window = SDL_CreateWindow("Tetris", 0, 0, w, h, 0);
-    if (!window)
-        Quit("main: Error! SDL_CreateWindow failed");
-    
-    // init renderer
-    renderer = SDL_CreateRenderer(window, -1, 0);
-    if (!renderer)
-        Quit("main: Error! SDL_CreateRenderer failed");
+    if (headless)
+    {
+        // no display or sound, draw into a surface in software
+        SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+        if (SDL_Init(SDL_INIT_VIDEO) != 0)
+            Quit("main: Error! SDL_Init failed");
+        
+        screen = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGBA32);
+        if (!screen)
+            Quit("main: Error! Could not create screen surface");
+        renderer = SDL_CreateSoftwareRenderer(screen);
+        if (!renderer)
+            Quit("main: Error! SDL_CreateSoftwareRenderer failed");
+    }
+    else
+    {
+        // init window, audio waits for the first sound
+        if (SDL_Init(SDL_INIT_VIDEO) != 0)
+            Quit("main: Error! SDL_Init failed");
+        MarkStage("SDL_Init");
+        
+        window = SDL_CreateWindow("Tetris", 0, 0, w, h, 0);
+        if (!window)
+            Quit("main: Error! SDL_CreateWindow failed");
+        MarkStage("window");
+        
+        // init renderer
+        renderer = SDL_CreateRenderer(window, -1, vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
+        if (!renderer)
+            Quit("main: Error! SDL_CreateRenderer failed");
+        MarkStage("renderer");
+    }
     SDL_RenderSetScale(renderer, DRAW_SCALE, DRAW_SCALE);
     SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
     
-    // init sound
-    Mix_OpenAudio(MIX_DEFAULT_FREQUENCY,MIX_DEFAULT_FORMAT,MIX_DEFAULT_CHANNELS,512);
-    Mix_Volume(-1, 8);
-    InitSounds();
-    
+    // with vsync, draw as often as the display refreshes
+    if (!drawrate && vsync && SDL_GetWindowDisplayMode(window, &mode) == 0)
+        drawrate = mode.refresh_rate;
+    if (drawrate <= 0)
+        drawrate = TICRATE;
     
     // init console/font
-    s = IMG_Load("assets/cgafont.png");
-    if (!s)
+    fontasset = assetdir ? WaitAsset(ASSET_FONT) : UnpackFont();
+    if (!fontasset->surface && !fontasset->rgba)
         Quit("main: Error! Could not load cgafont");
+    MarkStage("font wait");
     
-    font = SDL_CreateTextureFromSurface(renderer, s);
+    font = SDL_CreateTextureFromSurface(renderer, fontasset->surface ? fontasset->surface : fontasset->rgba);
     if (!font)
         Quit("main: Error! Could not create font texture");
-    SDL_FreeSurface(s);
+    fontsurface = fontasset->rgba; // ours now
+    fontasset->rgba = NULL;
+    if (fontsurface)
+        SDL_SetSurfaceBlendMode(fontsurface, SDL_BLENDMODE_NONE);
+    SDL_FreeSurface(fontasset->surface);
+    fontasset->surface = NULL;
+    MarkStage("font texture");
     
     rows = WINDOW_H / FONT_H;
     cols = WINDOW_W / FONT_W;
     
     InitPanel(&panels[PANEL_NEXT], 1, 1, 7, 6, "NEXT", NULL);
-    InitPanel(&panels[PANEL_LEVEL], 1, 9, 7, 5, "LEVEL", &level);
-    InitPanel(&panels[PANEL_SCORE], 1, 16, 7, 5, "SCORE", &score);
-    InitPanel(&panels[PANEL_LINES], 20, 1, 7, 5, "LINES", &numlines);
+    InitPanel(&panels[PANEL_LEVEL], 1, 9, 7, 5, "LEVEL", &game.level);
+    InitPanel(&panels[PANEL_SCORE], 1, 16, 7, 5, "SCORE", &game.score);
+    InitPanel(&panels[PANEL_LINES], 20, 1, 7, 5, "LINES", &game.numlines);
     InitPanel(&panels[PANEL_STATS], 20, 10, 7, 11, "STATS", NULL);
     
-    InitDropGuides();
-    
-    options[OPT_SOUND] = true;
+    options[OPT_SOUND] = !headless;
     options[OPT_SHOWGUIDE] = true;
     options[OPT_PAUSED] = false;
 }
@@ -404,263 +759,240 @@ void printc (int c)
     SDL_RenderCopy(renderer, font, &src, &dst);
 }
 
-// print a string at current cursor, can \n, moves cursor after printing
-void prints (const char *string)
-{
-    char *c = (char *)string;
-    while (*c != '\0')
-    {
-        if (*c == '\n' && csry != rows - 1) {
-            csry++;
-            csrx = 0;
-        } else {
-            printc(*c);
-            csrx++;
-        }
-        c++;
-    }
-}
-
-void printd (int d)
-{
-    char buffer[80];
-    sprintf(buffer, "%d", d);
-    prints(buffer);
-}
+//
+//  Text cache
+//  Runs of text are drawn into a texture once and then redrawn with a
+//  single copy for as long as the same text is printed at the same spot.
+//  Entries are keyed by the viewport origin and cursor position, so each
+//  panel value or line of a screen keeps its own entry, which is only
+//  rebuilt when what gets printed there changes.
+//
 
+#define TEXT_CACHE_SIZE 128 // power of two
+#define TEXT_MAX        40
+#define TEXT_PROBES     8
 
+typedef struct
+{
+    unsigned        key; // 0 if unused
+    char            text[TEXT_MAX];
+    int             len;
+    bool            isnumber;
+    int             number; // if isnumber, the value 'text' came from
+    SDL_Texture *   texture;
+} textentry_t;
 
+textentry_t textcache[TEXT_CACHE_SIZE];
 
-#pragma mark - GAME
 
-void InitGame (void)
+void FlushTextCache (void)
 {
-    memset(board, -1, sizeof(board));
-    score = 0;
-    level = INITIAL_LVL;
-    numlines = 0;
-    cyclelength = INITIAL_CYCLE;
-    cycletimer = cyclelength;
-    memset(completed, 0, sizeof(completed));
-    tet.spawn = true;
-    tet.slide = false;
-    nexttet = Random() % TET_COUNT;
-    playstate = PS_DROP;
+    int i;
+    
+    for (i=0 ; i<TEXT_CACHE_SIZE ; i++)
+        SDL_DestroyTexture(textcache[i].texture);
+    memset(textcache, 0, sizeof(textcache));
 }
 
 
-
 //
-// Collision
-// Check for collision between 'tet' (player's piece)
-// and the side, bottom, or blocks already on the board
+//  FindText
+//  Get the cache entry for text printed at the cursor. If it's not in the
+//  cache, an entry is claimed for it (with no texture).
 //
-bool Collision (int checkx, int checky)
+textentry_t * FindText (void)
 {
-    int x, y;
-    char * block; // check each block within 'tet'
-    
-    for (y=0 ; y<DATA_SIZE ; y++)
-        for (x=0 ; x<DATA_SIZE ; x++)
-        {
-            block = &shapes[tet.type][tet.rotation][y][x];
-            
-            if (*block && (x + checkx < 0 || x + checkx >= BOARD_W))
-                return true; // sit side
-            if (*block && y + checky >= BOARD_H)
-                return true; // hit bottom
-            if (*block && board[y + checky][x + checkx] >= 0)
-                return true; // hit a block
-        }
+    SDL_Rect        view;
+    unsigned        key;
+    int             i, slot;
+    textentry_t *   e;
     
-    return false;
-}
-
-
-
-
-void SpawnTetramino (void)
-{
-    memset(&tet, 0, sizeof(tetramino_t));
+    SDL_RenderGetViewport(renderer, &view);
+    key = ((unsigned)view.x << 20 ^ (unsigned)view.y << 10 ^ csry << 5 ^ csrx) + 1;
     
-    tet.type = nexttet;
-    nexttet = Random() % TET_COUNT;
-    tet.x = 3;
-    tet.y = tet.type == TET_O ? 1 : 0;
-    tet.rotation = 0;
+    slot = (key * 2654435761u) >> 16;
+    for (i=0 ; i<TEXT_PROBES ; i++)
+    {
+        e = &textcache[(slot + i) & (TEXT_CACHE_SIZE - 1)];
+        if (e->key == key)
+            return e;
+        if (e->key == 0)
+            break;
+    }
+    if (i == TEXT_PROBES) // full up, throw one out
+        e = &textcache[slot & (TEXT_CACHE_SIZE - 1)];
     
-    if (Collision(tet.x, tet.y))
-        gamestate = GS_GAMEOVER;
+    SDL_DestroyTexture(e->texture);
+    memset(e, 0, sizeof(*e));
+    e->key = key;
+    return e;
 }
 
 
-
-
 //
-// MoveTetramino
-// - Try to move the player-controlled tet
-// does not move and returns false
-// if the move results in a collision
+//  MakeText
+//  Build the texture for an entry from 'len' characters of 'text'.
+//  Returns false if it couldn't, and the text has to go out a character
+//  at a time.
 //
-bool MoveTetramino (int dx, int dy)
+bool MakeText (textentry_t * e, const char * text, int len)
 {
-    if (!Collision(tet.x + dx, tet.y + dy)) {
-        tet.x += dx;
-        tet.y += dy;
-        return true;
+    SDL_Surface *   s;
+    SDL_Rect        src, dst;
+    int             i;
+    
+    SDL_DestroyTexture(e->texture);
+    e->texture = NULL;
+    e->len = 0;
+    if (!fontsurface || len >= TEXT_MAX)
+        return false;
+    
+    s = SDL_CreateRGBSurfaceWithFormat(0, len * FONT_W, FONT_H, 32,
+                                       SDL_PIXELFORMAT_RGBA32);
+    if (!s)
+        return false;
+    
+    src.w = dst.w = FONT_W;
+    src.h = dst.h = FONT_H;
+    dst.y = 0;
+    for (i=0 ; i<len ; i++)
+    {
+        src.x = ((unsigned char)text[i] % 32) * FONT_W;
+        src.y = ((unsigned char)text[i] / 32) * FONT_H;
+        dst.x = i * FONT_W;
+        SDL_BlitSurface(fontsurface, &src, s, &dst);
     }
-    return false;
+    
+    e->texture = SDL_CreateTextureFromSurface(renderer, s);
+    SDL_FreeSurface(s);
+    if (!e->texture)
+        return false;
+    SDL_SetTextureBlendMode(e->texture, SDL_BLENDMODE_BLEND);
+    
+    memcpy(e->text, text, len);
+    e->text[len] = '\0';
+    e->len = len;
+    return true;
 }
 
 
-
-void RotateTetramino (void)
+// draw an entry's texture at the cursor and move the cursor past it
+void DrawText (textentry_t * e)
 {
-    tet.rotation = (tet.rotation + 1) % R_COUNT;
+    SDL_Rect dst = { csrx*FONT_W, csry*FONT_H, e->len*FONT_W, FONT_H };
     
-    if (Collision(tet.x, tet.y)) { // if collision, rotate it back
-        tet.rotation = (tet.rotation - 1) % R_COUNT;
-        return;
-    }
-    PlaySound(SND_ROTATE);
+    SDL_RenderCopy(renderer, e->texture, NULL, &dst);
+    csrx += e->len;
 }
 
 
-bool TilePresent (int x, int y)
+// print 'len' characters with no line breaks, moves cursor after printing
+void printrun (const char * text, int len)
 {
-    return shapes[tet.type][tet.rotation][y][x];
+    textentry_t * e;
+    int i;
+    
+    if (!reference)
+    {
+        e = FindText();
+        if (e->texture && !e->isnumber && e->len == len && !memcmp(e->text, text, len)) {
+            DrawText(e);
+            return;
+        }
+        
+        e->isnumber = false;
+        if (MakeText(e, text, len)) {
+            DrawText(e);
+            return;
+        }
+    }
+    
+    for (i=0 ; i<len ; i++) {
+        printc(text[i]);
+        csrx++;
+    }
 }
 
 
-
-void AddTetraminoToBoard (void)
+// print a string at current cursor, can \n, moves cursor after printing
+void prints (const char *string)
 {
-    int x, y;
+    const char *c = string;
+    int len;
     
-    for (y=0 ; y<DATA_SIZE ; y++) {
-        for (x=0 ; x<DATA_SIZE ; x++)
-        {
-            if (TilePresent(x, y))
-                board[y+tet.y][x+tet.x] = tet.type;
+    while (*c != '\0')
+    {
+        if (*c == '\n' && csry != rows - 1) {
+            csry++;
+            csrx = 0;
+            c++;
+            continue;
         }
+        
+        for (len=1 ; c[len] != '\0' && c[len] != '\n' ; len++)
+            ;
+        printrun(c, len);
+        c += len;
     }
-    stats[tet.type] = (stats[tet.type] + 1) % 999;
-    tet.spawn = true;
 }
 
-
-
-//
-//  UpdateTetramino
-//  Move tet down, and add to board if collision.
-//  Mark completed lines, and set cycle timer accordingly.
-//
-int UpdateTetramino (void)
+void printd (int d)
 {
-    int x, y;
-    int tics;
-    
-    tics = cyclelength;
-    
-    // give a small amount of time to slide the piece
-    if (Collision(tet.x, tet.y + 1) && !tet.slide) {
-        tet.slide = true;
-        return SLIDE_TIME;
-    }
-    tet.slide = false;
+    textentry_t * e = NULL;
+    char buffer[80];
+    int len;
     
-    // MOVE DOWN
-    if (!MoveTetramino(0, 1))
-    {
-        AddTetraminoToBoard();
-        tics = 0;
+    // the number is only formatted when it changes
+    if (!reference) {
+        e = FindText();
+        if (e->texture && e->isnumber && e->number == d) {
+            DrawText(e);
+            return;
+        }
     }
     
-    // mark any completed rows
-    bool gotline;
-    for (y=0 ; y<BOARD_H ; y++)
-    {
-        gotline = true;
-        for (x=0 ; x<BOARD_W ; x++)
-        {
-            if (board[y][x] == -1) {
-                gotline = false;
-                break;
-            }
-        }
-        if (gotline)
-        {
-            completed[y] = true;
-            fadetimer += 15; // clearing more lines takes longer
-        }
+    len = sprintf(buffer, "%d", d);
+    if (e && MakeText(e, buffer, len)) {
+        e->isnumber = true;
+        e->number = d;
+        DrawText(e);
+        return;
     }
-
-    return tics;
+    printrun(buffer, len);
 }
 
 
-void UpdateGame (void)
-{
-    int x, y, y1;
-    int linecnt = 0;
 
-    if (fadetimer) {
-        --fadetimer;
-        return; // don't process anything while line(s) fading
-    }
-    
-    if (tet.spawn) {
-        SpawnTetramino();
-        tet.spawn = false;
-    }
-    
-    // remove completed lines
-    for (y=0 ; y<BOARD_H ; y++)
-    {
-        if (!completed[y])
-            continue;
-        
-        linecnt++;
-        score += 25;
-        numlines++;
-        
-        // move all higher rows down one
-        for (y1=y; y1>0; y1--)
-            for (x=0; x<BOARD_W; x++)
-                board[y1][x] = board[y1-1][x];
-        
-        completed[y] = false;
-    }
-    // play sound
-    if (linecnt == 4)
+
+#pragma mark - GAME
+
+//
+//  PlayEvents
+//  Play the sounds for anything that happened during a game frame
+//
+void PlayEvents (int events)
+{
+    if (events & EV_MOVE)
+        PlaySound(SND_MOVE);
+    if (events & EV_ROTATE)
+        PlaySound(SND_ROTATE);
+    if (events & EV_DROP)
+        PlaySound(SND_DROP);
+    
+    if (events & EV_TETRIS)
         PlaySound(SND_TETRIS);
-    else if (linecnt)
+    else if (events & EV_LINE)
         PlaySound(SND_LINE);
     
-    
-    // CHECK FOR NEXT LEVEL
-    
-    if (numlines / LINES_PER_LVL > level ) {
-        level++;
-        cyclelength -= CYCLE_DECR;
-        if (cyclelength < CYCLE_DECR)
-            cyclelength = CYCLE_DECR;
+    if (events & EV_LEVELUP)
         PlaySound(SND_LEVELUP);
-    }
-
-    
-    // MOVE PIECE DOWN ONCE PER CYCLE
-    
-    if (--cycletimer <= 0) {
-        cycletimer = UpdateTetramino();
-    }
 }
 
 
 #pragma mark -
 
 
-void DrawCenterWindow (const char * text, bool blink)
+void DrawCenterWindow (const char * text, bool show)
 {
     SDL_Rect r;
     int len;
@@ -691,52 +1023,234 @@ void DrawCenterWindow (const char * text, bool blink)
     }
 
     gotoxy(1, 1);
-    if (blink && SDL_GetTicks() % 600 < 300) {
-        prints(text);
-    } else if (!blink) {
+    if (show) // off for the dark half of a blink
         prints(text);
-    }
     SDL_RenderSetViewport(renderer, NULL);
 }
 
 
 
 
+//
+//  Tile batch
+//  DrawTile only queues a tile; FlushTiles draws everything queued. Usually
+//  that is one copy per tile from the tile atlas, submitted together. The
+//  atlas itself is drawn with one SDL_RenderFillRects per colour. Either
+//  way, queued tiles must not overlap, and must be flushed before anything
+//  else is drawn over them or the viewport changes. With -reference each
+//  tile is drawn from rects as soon as it is queued.
+//
+
+#define MAX_TILES   (WINDOW_W / TILE_SIZE * WINDOW_H / TILE_SIZE)
+
+typedef struct
+{
+    short       x, y; // screen coords
+    tettype_t   type;
+} tile_t;
+
+tile_t      tiles[MAX_TILES];
+int         numtiles;
+
+void FlushTiles (void);
+
 void DrawTile (int x, int y, tettype_t type)
 {
-    SDL_Rect    bdrect, fgrect;
-    SDL_Color   *bd, *fg;
+    if (numtiles == MAX_TILES)
+        FlushTiles();
+    
+    tiles[numtiles].x = x * TILE_SIZE; // convert to screen coords
+    tiles[numtiles].y = y * TILE_SIZE;
+    tiles[numtiles].type = type;
+    numtiles++;
+    if (reference)
+        FlushTiles(); // drawn one at a time
+}
+
+
+//
+//  FillTileRects
+//  Fill one rect per queued tile, inset by 'inset', in the colour that
+//  'palette' gives its type. Rects are sorted by colour so each colour
+//  is a single draw call.
+//
+void FillTileRects (int * palette, int inset)
+{
+    static SDL_Rect rects[MAX_TILES];
+    int             start[CGA_NUMCOLORS + 1];
+    int             next[CGA_NUMCOLORS];
+    int             i, c;
+    
+    memset(start, 0, sizeof(start));
+    for (i=0 ; i<numtiles ; i++)
+        start[palette[tiles[i].type] + 1]++;
+    for (c=0 ; c<CGA_NUMCOLORS ; c++) {
+        start[c+1] += start[c];
+        next[c] = start[c];
+    }
+    
+    for (i=0 ; i<numtiles ; i++)
+    {
+        c = palette[tiles[i].type];
+        rects[next[c]++] = (SDL_Rect){
+            tiles[i].x + inset, tiles[i].y + inset,
+            TILE_SIZE - inset * 2, TILE_SIZE - inset * 2
+        };
+    }
+    
+    for (c=0 ; c<CGA_NUMCOLORS ; c++)
+    {
+        if (start[c+1] == start[c])
+            continue;
+        SetColor(&colors[c]);
+        SDL_RenderFillRects(renderer, &rects[start[c]], start[c+1] - start[c]);
+    }
+}
+
+
+//
+//  FillTiles
+//  Build the queued tiles from rects and points. As they don't overlap,
+//  drawing all borders, then all faces, then the shading gives the same
+//  picture as drawing them one at a time.
+//
+void FillTiles (void)
+{
+    static SDL_Rect     edges[MAX_TILES * 2];
+    static SDL_Point    corners[MAX_TILES * 4];
+    int                 i, x, y;
+    
+    FillTileRects(bdcolors, 0);
+    FillTileRects(fgcolors, 1);
+    
+    if (!flatstyle)
+    {
+        for (i=0 ; i<numtiles ; i++)
+        {
+            x = tiles[i].x;
+            y = tiles[i].y;
+            edges[i*2] = (SDL_Rect){ x + TILE_SIZE - 1, y, 1, TILE_SIZE };
+            edges[i*2+1] = (SDL_Rect){ x, y + TILE_SIZE - 1, TILE_SIZE, 1 };
+            corners[i*4] = (SDL_Point){ x, y };
+            corners[i*4+1] = (SDL_Point){ x, y + TILE_SIZE - 1 };
+            corners[i*4+2] = (SDL_Point){ x + TILE_SIZE - 1, y };
+            corners[i*4+3] = (SDL_Point){ x + TILE_SIZE - 1, y + TILE_SIZE - 1 };
+        }
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 128);
+        SDL_RenderFillRects(renderer, edges, numtiles * 2);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderDrawPoints(renderer, corners, numtiles * 4);
+    }
+}
+
+
+//
+//  CopyTiles
+//  Draw the queued tiles from the atlas, all in one call if the renderer
+//  can take geometry
+//
+void CopyTiles (void)
+{
+    SDL_Rect src, dst;
+    int i;
     
-    x *= TILE_SIZE; // convert to screen coords
-    y *= TILE_SIZE;
+    src.y = flatstyle ? 0 : TILE_SIZE;
+    src.w = dst.w = TILE_SIZE;
+    src.h = dst.h = TILE_SIZE;
     
-    bdrect = (SDL_Rect){ x, y, TILE_SIZE, TILE_SIZE };
-    fgrect = (SDL_Rect){ x + 1, y + 1, TILE_SIZE - 2, TILE_SIZE - 2 };
-    bd = &colors[bdcolors[type]];
-    fg = &colors[fgcolors[type]];
-    SetColor(bd);
-    SDL_RenderFillRect(renderer, &bdrect);
-    SetColor(fg);
-    SDL_RenderFillRect(renderer, &fgrect);
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    static SDL_Vertex   verts[MAX_TILES * 4];
+    static int          indices[MAX_TILES * 6];
+    const float         texw = TET_TOTAL * TILE_SIZE;
+    const float         texh = 2 * TILE_SIZE;
+    SDL_Vertex *        v;
+    int *               index;
     
-    if (flatstyle)
+    for (i=0 ; i<numtiles ; i++)
+    {
+        src.x = tiles[i].type * TILE_SIZE;
+        v = &verts[i*4];
+        v[0].position = (SDL_FPoint){ tiles[i].x, tiles[i].y };
+        v[1].position = (SDL_FPoint){ tiles[i].x + TILE_SIZE, tiles[i].y };
+        v[2].position = (SDL_FPoint){ tiles[i].x + TILE_SIZE, tiles[i].y + TILE_SIZE };
+        v[3].position = (SDL_FPoint){ tiles[i].x, tiles[i].y + TILE_SIZE };
+        v[0].tex_coord = (SDL_FPoint){ src.x / texw, src.y / texh };
+        v[1].tex_coord = (SDL_FPoint){ (src.x + TILE_SIZE) / texw, src.y / texh };
+        v[2].tex_coord = (SDL_FPoint){ (src.x + TILE_SIZE) / texw, (src.y + TILE_SIZE) / texh };
+        v[3].tex_coord = (SDL_FPoint){ src.x / texw, (src.y + TILE_SIZE) / texh };
+        v[0].color = v[1].color = v[2].color = v[3].color = (SDL_Color){ 255, 255, 255, 255 };
+        
+        index = &indices[i*6];
+        index[0] = i*4;     index[1] = i*4 + 1; index[2] = i*4 + 2;
+        index[3] = i*4;     index[4] = i*4 + 2; index[5] = i*4 + 3;
+    }
+    if (SDL_RenderGeometry(renderer, tileatlas, verts, numtiles * 4,
+                           indices, numtiles * 6) == 0)
+        return;
+#endif
+    
+    // one at a time, SDL still batches these itself
+    for (i=0 ; i<numtiles ; i++)
+    {
+        src.x = tiles[i].type * TILE_SIZE;
+        dst.x = tiles[i].x;
+        dst.y = tiles[i].y;
+        SDL_RenderCopy(renderer, tileatlas, &src, &dst);
+    }
+}
+
+
+void FlushTiles (void)
+{
+    if (!numtiles)
         return;
     
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 128);
-    bdrect.w = 1;
-    bdrect.x = x + TILE_SIZE - 1;
-    SDL_RenderFillRect(renderer, &bdrect);
-    bdrect.w = TILE_SIZE;
-    bdrect.h = 1;
-    bdrect.x = x;
-    bdrect.y = y + TILE_SIZE - 1;
-    SDL_RenderFillRect(renderer, &bdrect);
+    if (atlasvalid)
+        CopyTiles();
+    else
+        FillTiles();
+    numtiles = 0;
+}
+
+
+//
+//  BakeTileAtlas
+//  Draw every tile type, flat in the top row and shaded in the bottom
+//  row, into the atlas texture. Only needs doing again if the texture
+//  is lost or the colours change.
+//
+void BakeTileAtlas (void)
+{
+    bool    style;
+    int     row, t;
+    
+    atlasvalid = false;
+    if (!tileatlas && SDL_RenderTargetSupported(renderer)) {
+        tileatlas = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
+                                      SDL_TEXTUREACCESS_TARGET,
+                                      TET_TOTAL * TILE_SIZE, 2 * TILE_SIZE);
+        if (tileatlas)
+            SDL_SetTextureBlendMode(tileatlas, SDL_BLENDMODE_NONE); // opaque
+    }
+    if (!tileatlas)
+        return; // fall back to drawing tiles from rects
     
+    FlushTiles();
+    style = flatstyle;
+    BeginTarget(tileatlas);
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderDrawPoint(renderer, x, y);
-    SDL_RenderDrawPoint(renderer, x, y+TILE_SIZE-1);
-    SDL_RenderDrawPoint(renderer, x+TILE_SIZE-1, y);
-    SDL_RenderDrawPoint(renderer, x+TILE_SIZE-1, y+TILE_SIZE-1);
+    SDL_RenderClear(renderer);
+    for (row=0 ; row<2 ; row++)
+    {
+        flatstyle = row == 0;
+        for (t=0 ; t<TET_TOTAL ; t++)
+            DrawTile(t, row, t);
+        FillTiles();
+        numtiles = 0;
+    }
+    EndTarget();
+    flatstyle = style;
+    atlasvalid = true;
 }
 
 
@@ -750,6 +1264,7 @@ void DrawBackground (void)
         {
             DrawTile(x, y, TET_BORDER);
         }
+    FlushTiles();
     
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
     SDL_RenderFillRect(renderer, NULL);
@@ -766,11 +1281,11 @@ void DrawBackground (void)
 }
 
 
-void DrawPanels (void)
+// the parts of the panels that don't change
+void DrawPanelFrames (void)
 {
     panel_t * p;
     int i;
-    int x, y;
     
     for (i=0 ; i<PANEL_COUNT ; i++)
     {
@@ -779,117 +1294,501 @@ void DrawPanels (void)
         SDL_RenderFillRect(renderer, &p->rect);
         SDL_RenderSetViewport(renderer, &p->rect);
         gotoxy(1, 1); prints(p->name);
-        if (p->data) {
-            gotoxy(1, 3); printd(*p->data);
-        }
-        if (i == PANEL_NEXT && gamestate != GS_GAMEOVER) {
-            for (y=0 ; y<DATA_SIZE ; y++) {
-                for (x=0 ; x<DATA_SIZE ; x++) {
-                    if (displayshapes[nexttet][y][x])
-                        DrawTile(x+1, y+3, nexttet);
-                }
-            }
-        }
         if (i == PANEL_STATS) {
-            for (i=0 ; i<TET_COUNT ; i++) {
+            for (i=0 ; i<TET_COUNT ; i++)
                 DrawTile(1, i+3, i);
-                gotoxy(3, i+3);
-                printd(stats[i]);
-            }
         }
+        FlushTiles();
         SDL_RenderSetViewport(renderer, NULL);
     }
 }
 
 
+// the parts of a panel that change, drawn over its frame
+void DrawPanel (int i)
+{
+    panel_t * p;
+    const cell_t * c;
+    int t;
+    
+    p = &panels[i];
+    SDL_RenderSetViewport(renderer, &p->rect);
+    if (p->data) {
+        gotoxy(1, 3); printd(*p->data);
+    }
+    if (i == PANEL_NEXT && gamestate != GS_GAMEOVER) {
+        for (c=displaycells[game.nexttet] ; c<displaycells[game.nexttet]+4 ; c++)
+            DrawTile(c->x+1, c->y+3, game.nexttet);
+    }
+    if (i == PANEL_STATS) {
+        for (t=0 ; t<TET_COUNT ; t++) {
+            gotoxy(3, t+3);
+            printd(game.stats[t]);
+        }
+    }
+    FlushTiles();
+    SDL_RenderSetViewport(renderer, NULL);
+}
+
+
+
+//
+//  FillGuideBeam
+//  A solid column that fades to black one scanline at a time
+//
+void FillGuideBeam (SDL_Rect * beam)
+{
+    int         alpha;
+    SDL_Rect    blend;
+    
+    SDL_SetRenderDrawColor(renderer, 24, 24, 24, 255);
+    SDL_RenderFillRect(renderer, beam);
+    blend.x = beam->x;
+    blend.y = beam->y;
+    blend.w = beam->w;
+    blend.h = 1;
+    alpha = 0;
+    while (blend.y < beam->y + beam->h) {
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, alpha);
+        SDL_RenderFillRect(renderer, &blend);
+        blend.y++;
+        alpha += 1;
+        if (alpha > 255)
+            alpha = 255;
+    }
+}
+
+
+//
+//  BakeDropGuide
+//  Render a full-height beam into a texture once. Every beam starts at
+//  the top of the gradient, so drawing one is a copy of its top part.
+//
+void BakeDropGuide (void)
+{
+    SDL_Rect beam = { 0, 0, TILE_SIZE, BOARD_H * TILE_SIZE };
+    
+    guidevalid = false;
+    if (!guidebeam && SDL_RenderTargetSupported(renderer)) {
+        guidebeam = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
+                                      SDL_TEXTUREACCESS_TARGET,
+                                      beam.w, beam.h);
+        if (guidebeam)
+            SDL_SetTextureBlendMode(guidebeam, SDL_BLENDMODE_NONE);
+    }
+    if (!guidebeam)
+        return; // draw it by scanlines instead
+    
+    BeginTarget(guidebeam);
+    FillGuideBeam(&beam);
+    EndTarget();
+    guidevalid = true;
+}
+
 
 void DrawDropGuide (void)
 {
     int         x;
-    int         alpha;
     SDL_Rect    beam;
-    SDL_Rect    blend;
+    SDL_Rect    src;
+    const int8_t * guide;
 
     beam.w = TILE_SIZE;
-    blend.w = TILE_SIZE;
-    blend.h = 1;
+    guide = pieces[game.tet.type][game.tet.rotation].guide;
     for (x=0 ; x<DATA_SIZE ; x++)
     {
-        if (guidedata[tet.type][tet.rotation][x] != -1) {
-            beam.x = (x + tet.x) * TILE_SIZE;
-            beam.y = (guidedata[tet.type][tet.rotation][x] + tet.y) * TILE_SIZE;
+        if (guide[x] != -1) {
+            beam.x = (x + game.tet.x) * TILE_SIZE;
+            beam.y = (guide[x] + game.tet.y) * TILE_SIZE;
             beam.h = BOARD_H * TILE_SIZE - beam.y;
-            SDL_SetRenderDrawColor(renderer, 24, 24, 24, 255);
-            SDL_RenderFillRect(renderer, &beam);
-            blend.x = beam.x;
-            blend.y = beam.y;
-            alpha = 0;
-            while (blend.y < BOARD_H * TILE_SIZE) {
-                SDL_SetRenderDrawColor(renderer, 0, 0, 0, alpha);
-                SDL_RenderFillRect(renderer, &blend);
-                blend.y++;
-                alpha += 1;
-                if (alpha > 255)
-                    alpha = 255;
+            if (guidevalid) {
+                src = (SDL_Rect){ 0, 0, beam.w, beam.h };
+                SDL_RenderCopy(renderer, guidebeam, &src, &beam);
+            } else {
+                FillGuideBeam(&beam);
             }
         }
     }
 }
 
 
+// all of the board including the hidden top row
+SDL_Rect boardrect = {
+    9*TILE_SIZE, 0, BOARD_W*TILE_SIZE, BOARD_H*TILE_SIZE
+};
+
 void DrawBoard (void)
 {
     int x, y;
-    
-    // visible area
-    SDL_Rect boardrect = {
-        9*TILE_SIZE, 1*TILE_SIZE, BOARD_W*TILE_SIZE, (BOARD_H-1)*TILE_SIZE
-    };
-
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderFillRect(renderer, &boardrect);
+    const cell_t * cells, * c;
 
-    boardrect.y = 0;
-    boardrect.h = BOARD_H*TILE_SIZE;
     SDL_RenderSetViewport(renderer, &boardrect);
     
     if (options[OPT_SHOWGUIDE] && gamestate != GS_GAMEOVER) {
         DrawDropGuide();
     }
     
-    // player tetramino
-    for (y=0 ; y<DATA_SIZE ; y++) {
-        for (x=0 ; x<DATA_SIZE ; x++)
-        {
-            if (shapes[tet.type][tet.rotation][y][x])
-                DrawTile(x+tet.x, y+tet.y, tet.type);
-        }
+    // player tetramino, except where a landed or fading tile covers it
+    cells = pieces[game.tet.type][game.tet.rotation].cells;
+    for (c=cells ; c<cells+4 ; c++)
+    {
+        x = c->x + game.tet.x;
+        y = c->y + game.tet.y;
+        if (game.board[y][x] == -1 && !(game.fadetimer && game.completed[y]))
+            DrawTile(x, y, game.tet.type);
     }
     
     // landed pieces
     for (y=0 ; y<BOARD_H ; y++)
         for (x=0 ; x<BOARD_W ; x++)
         {
-            if (fadetimer && completed[y]) {
+            if (game.fadetimer && game.completed[y]) {
                 DrawTile(x, y, Random() % TET_COUNT);
-            } else if (board[y][x] != -1) {
-                DrawTile(x, y, board[y][x]);
+            } else if (game.board[y][x] != -1) {
+                DrawTile(x, y, game.board[y][x]);
             }
         }
+    FlushTiles();
     
     SDL_RenderSetViewport(renderer, NULL);
 }
 
-void DrawAll (void)
+//
+//  DrawStaticLayer
+//  Everything that only changes with the style: the background, panel
+//  frames and labels, and the empty board.
+//
+void DrawStaticLayer (void)
 {
+    // visible area of the board
+    SDL_Rect boardrect = {
+        9*TILE_SIZE, 1*TILE_SIZE, BOARD_W*TILE_SIZE, (BOARD_H-1)*TILE_SIZE
+    };
+    
     SDL_SetRenderDrawColor(renderer, 32, 32, 32, 255);
     SDL_RenderClear(renderer);
     DrawBackground();
-    DrawPanels();
-    DrawBoard();
-    if (options[OPT_PAUSED])
-        DrawCenterWindow("PAUSED", true);
+    DrawPanelFrames();
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderFillRect(renderer, &boardrect);
+}
+
+
+//
+//  UpdateStatic
+//  Render the static layer into its texture if it has been invalidated.
+//  Returns false if there is no texture, because the renderer can't do
+//  render targets.
+//
+bool UpdateStatic (void)
+{
+    if (!staticlayer && SDL_RenderTargetSupported(renderer)) {
+        staticlayer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
+                                        SDL_TEXTUREACCESS_TARGET,
+                                        WINDOW_W, WINDOW_H);
+        if (staticlayer)
+            SDL_SetTextureBlendMode(staticlayer, SDL_BLENDMODE_NONE);
+        staticvalid = false;
+    }
+    
+    if (!staticlayer)
+        return false;
+    
+    if (!staticvalid) {
+        BeginTarget(staticlayer);
+        DrawStaticLayer();
+        EndTarget();
+        staticvalid = true;
+    }
+    return true;
+}
+
+
+//====================
+//  DAMAGE TRACKING
+//====================
+
+//
+// DrawAll only redraws the parts of the screen whose contents changed
+// since the last frame, into 'framelayer', and only presents if
+// something did. To find out what changed, it keeps a copy of
+// everything that was on screen.
+//
+
+enum
+{
+    DIRTY_BOARD     = 1 << PANEL_COUNT, // panels are bits 0 to PANEL_COUNT-1
+    DIRTY_WINDOW    = 1 << (PANEL_COUNT + 1),
+    DIRTY_ALL       = (1 << (PANEL_COUNT + 2)) - 1
+};
+
+typedef struct
+{
+    signed char     board[BOARD_H][BOARD_W];
+    bool            completed[BOARD_H];
+    int             tetx, tety;
+    tettype_t       tettype;
+    rotation_t      tetrotation;
+    bool            fading;
+    bool            showguide;
+    bool            gameover;
+    
+    tettype_t       nexttet;
+    int             level;
+    int             score;
+    int             numlines;
+    int             stats[TET_COUNT];
+    
+    const char *    windowtext;
+    bool            textshown;
+} screen_t;
+
+screen_t        drawn; // what is on screen now
+int             dirty = DIRTY_ALL;
+const char *    centertext; // a message other than PAUSED for the center
+
+
+// something else drew over the screen, draw it all next time
+void RedrawAll (void)
+{
+    dirty = DIRTY_ALL;
+}
+
+
+//
+//  CheckDirty
+//  Compare what should be on screen with what is, and mark the regions
+//  that differ as dirty
+//
+void CheckDirty (void)
+{
+    screen_t    now;
+    int         i;
+    
+    memset(&now, 0, sizeof(now));
+    memcpy(now.board, game.board, sizeof(now.board));
+    memcpy(now.completed, game.completed, sizeof(now.completed));
+    now.tetx = game.tet.x;
+    now.tety = game.tet.y;
+    now.tettype = game.tet.type;
+    now.tetrotation = game.tet.rotation;
+    now.fading = game.fadetimer != 0;
+    now.showguide = options[OPT_SHOWGUIDE];
+    now.gameover = gamestate == GS_GAMEOVER;
+    
+    now.nexttet = game.nexttet;
+    now.level = game.level;
+    now.score = game.score;
+    now.numlines = game.numlines;
+    memcpy(now.stats, game.stats, sizeof(now.stats));
+    
+    now.windowtext = options[OPT_PAUSED] ? "PAUSED" : centertext;
+    now.textshown = !options[OPT_PAUSED] || SDL_GetTicks() % 600 < 300;
+    
+    if (memcmp(now.board, drawn.board, sizeof(now.board))
+        || memcmp(now.completed, drawn.completed, sizeof(now.completed))
+        || now.tetx != drawn.tetx || now.tety != drawn.tety
+        || now.tettype != drawn.tettype
+        || now.tetrotation != drawn.tetrotation
+        || now.showguide != drawn.showguide
+        || now.gameover != drawn.gameover
+        || now.fading // fading lines flash a new colour every frame
+        || drawn.fading) // and the last flash has to be covered
+        dirty |= DIRTY_BOARD;
+    
+    if (now.nexttet != drawn.nexttet || now.gameover != drawn.gameover)
+        dirty |= 1 << PANEL_NEXT;
+    if (now.level != drawn.level)
+        dirty |= 1 << PANEL_LEVEL;
+    if (now.score != drawn.score)
+        dirty |= 1 << PANEL_SCORE;
+    if (now.numlines != drawn.numlines)
+        dirty |= 1 << PANEL_LINES;
+    for (i=0 ; i<TET_COUNT ; i++)
+        if (now.stats[i] != drawn.stats[i])
+            dirty |= 1 << PANEL_STATS;
+    
+    if (now.windowtext != drawn.windowtext)
+        dirty = DIRTY_ALL; // uncover whatever was underneath
+    else if (now.windowtext && now.textshown != drawn.textshown)
+        dirty |= DIRTY_WINDOW;
+    
+    drawn = now;
+}
+
+
+//
+//  DrawDirty
+//  Draw the dirty regions. 'copystatic' says if the static layer texture
+//  can be used to restore the background under a region.
+//
+void DrawDirty (bool copystatic)
+{
+    int i;
+    
+    if (dirty == DIRTY_ALL || !copystatic) {
+        PROF_BEGIN(PH_BACKGROUND);
+        if (copystatic)
+            SDL_RenderCopy(renderer, staticlayer, NULL, NULL);
+        else
+            DrawStaticLayer();
+        dirty = DIRTY_ALL;
+        PROF_END(PH_BACKGROUND);
+    }
+    
+    PROF_BEGIN(PH_PANELS);
+    for (i=0 ; i<PANEL_COUNT ; i++)
+    {
+        if (dirty & (1 << i)) {
+            if (dirty != DIRTY_ALL)
+                SDL_RenderCopy(renderer, staticlayer, &panels[i].rect, &panels[i].rect);
+            DrawPanel(i);
+        }
+    }
+    PROF_END(PH_PANELS);
+    
+    if (dirty & DIRTY_BOARD) {
+        PROF_BEGIN(PH_BOARD);
+        if (dirty != DIRTY_ALL)
+            SDL_RenderCopy(renderer, staticlayer, &boardrect, &boardrect);
+        DrawBoard();
+        dirty |= DIRTY_WINDOW; // it's on top of the board
+        PROF_END(PH_BOARD);
+    }
+    
+    if ((dirty & DIRTY_WINDOW) && drawn.windowtext) {
+        PROF_BEGIN(PH_WINDOW);
+        DrawCenterWindow(drawn.windowtext, drawn.textshown);
+        PROF_END(PH_WINDOW);
+    }
+}
+
+
+
+#ifdef PROFILE
+//
+//  DrawOverlay
+//  Frame time percentiles and draw calls over the top row. Goes on the
+//  back buffer after the frame layer so it never gets into the frame.
+//
+void DrawOverlay (void)
+{
+    profsummary_t   sum;
+    char            buffer[80];
+    SDL_Rect        bar = { 0, 0, WINDOW_W, FONT_H };
+    
+    ProfSummary(&sum);
+    snprintf(buffer, sizeof(buffer), "%5.2f/%5.2fms %3dF %3dC",
+             sum.p50, sum.p99, sum.counts[PC_FILL], sum.counts[PC_COPY]);
+    
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderFillRect(renderer, &bar);
+    gotoxy(0, 0);
+    prints(buffer);
+}
+#endif
+
+
+//
+//  DrawAll
+//  Bring the screen up to date. Returns false if nothing had changed
+//  and the last frame was left up without presenting.
+//
+bool DrawAll (void)
+{
+    bool copystatic;
+    
+    if (!reference) {
+        if (!atlasvalid)
+            BakeTileAtlas();
+        if (!guidevalid)
+            BakeDropGuide();
+    }
+    if (!staticvalid)
+        dirty = DIRTY_ALL;
+    copystatic = !reference && UpdateStatic(); // no static layer, so no frame layer either
+    
+    CheckDirty();
+    if (reference)
+        dirty = DIRTY_ALL;
+#ifdef PROFILE
+    if (profoverlay && !framelayer)
+        dirty = DIRTY_ALL; // the overlay has to be drawn over
+    if (!dirty && !profoverlay)
+        return false;
+#else
+    if (!dirty)
+        return false; // nothing changed, leave the last frame up
+#endif
+    
+    if (!framelayer && copystatic) {
+        framelayer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
+                                       SDL_TEXTUREACCESS_TARGET,
+                                       WINDOW_W, WINDOW_H);
+        if (framelayer)
+            SDL_SetTextureBlendMode(framelayer, SDL_BLENDMODE_NONE);
+        dirty = DIRTY_ALL;
+    }
+    
+    if (framelayer) {
+        BeginTarget(framelayer);
+        DrawDirty(true);
+        EndTarget();
+        SDL_RenderCopy(renderer, framelayer, NULL, NULL);
+    } else {
+        DrawDirty(false); // the back buffer has to be drawn in full
+    }
+    
+#ifdef PROFILE
+    if (profoverlay)
+        DrawOverlay();
+#endif
+    
+    PROF_BEGIN(PH_PRESENT);
     SDL_RenderPresent(renderer);
+    PROF_END(PH_PRESENT);
+    dirty = 0;
+    
+    if (!started) {
+        started = true;
+        MarkStage("first present");
+        if (showstartup)
+            ReportStartup();
+    }
+    return true;
+}
+
+
+
+//
+//  DoRenderEvent
+//  Textures that are render targets lose their contents when the
+//  renderer resets
+//
+void DoRenderEvent (SDL_Event * event)
+{
+    if (event->type == SDL_RENDER_TARGETS_RESET) {
+        staticvalid = false;
+        atlasvalid = false;
+        guidevalid = false;
+        RedrawAll();
+    } else if (event->type == SDL_RENDER_DEVICE_RESET) {
+        FlushTextCache();
+        SDL_DestroyTexture(staticlayer); // gone with the device
+        SDL_DestroyTexture(tileatlas);
+        SDL_DestroyTexture(framelayer);
+        SDL_DestroyTexture(guidebeam);
+        staticlayer = NULL;
+        tileatlas = NULL;
+        framelayer = NULL;
+        guidebeam = NULL;
+        atlasvalid = false;
+        guidevalid = false;
+        RedrawAll();
+    } else if (event->type == SDL_WINDOWEVENT
+               && event->window.event == SDL_WINDOWEVENT_EXPOSED) {
+        RedrawAll();
+    }
 }
 
 
@@ -907,11 +1806,13 @@ void IncognitoMode (void)
     {
         while (SDL_PollEvent(&event))
         {
+            DoRenderEvent(&event);
             if (event.type == SDL_QUIT)
                 Quit(NULL);
             else if (event.type == SDL_KEYDOWN) {
                 if (event.key.keysym.sym == SDLK_ESCAPE) {
                     SDL_RenderSetScale(renderer, DRAW_SCALE, DRAW_SCALE);
+                    RedrawAll();
                     return;
                 } else if (event.key.keysym.sym == SDLK_q) {
                     Quit(NULL);
@@ -950,7 +1851,215 @@ void SetWindowPosition (SDL_Keycode key)
 
 
 
-void DoKeyDown (SDL_Keycode key)
+//====================
+//  INPUT QUEUE
+//====================
+
+//
+//  Game keys are queued with the time they were pressed or released and
+//  handed to the step that was due when that happened, so a burst of
+//  steps after a stall still sees them in the right order. Side keys
+//  auto-repeat in steps (DAS/ARR), the OS key repeat is not used.
+//
+
+#define MAX_KEYEVENTS   64
+
+typedef struct
+{
+    Uint64      time; // performance counter
+    int         bit; // IN_*
+    bool        down;
+} keyevent_t;
+
+keyevent_t  keyqueue[MAX_KEYEVENTS];
+int         keyhead, keycount;
+
+int         keysheld; // IN_* bits of game keys down
+int         shiftkey; // IN_LEFT or IN_RIGHT being auto-repeated, or 0
+int         shifttics;
+
+
+//
+//  EventTime
+//  SDL event timestamps are in ms from SDL_GetTicks, convert one to the
+//  performance counter, relative to 'now'.
+//
+Uint64 EventTime (Uint32 timestamp, Uint64 now)
+{
+    Uint64 age = (Uint64)(Uint32)(SDL_GetTicks() - timestamp);
+    
+    age = age * SDL_GetPerformanceFrequency() / 1000;
+    return age < now ? now - age : 0;
+}
+
+
+//
+//  QueueKey
+//  When the queue is full a press is dropped, but never a release, or
+//  the key would stay held and keep auto-repeating. A release makes
+//  room by dropping the oldest press instead.
+//
+void QueueKey (Uint64 time, int bit, bool down)
+{
+    keyevent_t * e;
+    int          i;
+    
+    if (keycount == MAX_KEYEVENTS)
+    {
+        if (down)
+            return; // drop it
+        for (i=0 ; i<keycount && !keyqueue[(keyhead + i) % MAX_KEYEVENTS].down ; i++)
+            ;
+        if (i == keycount)
+            return; // all releases, can't happen
+        for ( ; i<keycount-1 ; i++)
+            keyqueue[(keyhead + i) % MAX_KEYEVENTS] = keyqueue[(keyhead + i + 1) % MAX_KEYEVENTS];
+        keycount--;
+    }
+    e = &keyqueue[(keyhead + keycount++) % MAX_KEYEVENTS];
+    e->time = time;
+    e->bit = bit;
+    e->down = down;
+}
+
+
+void ClearKeys (void)
+{
+    keyhead = keycount = 0;
+    keysheld = shiftkey = shifttics = 0;
+}
+
+
+//
+//  TakeInput
+//  Get the input for the step that was due at 'due'. If a key press
+//  is in it, its time is put in 'presstime'.
+//
+int TakeInput (Uint64 due, Uint64 * presstime)
+{
+    keyevent_t *    e;
+    int             input = 0;
+    
+    *presstime = 0;
+    while (keycount && keyqueue[keyhead].time <= due)
+    {
+        e = &keyqueue[keyhead];
+        keyhead = (keyhead + 1) % MAX_KEYEVENTS;
+        keycount--;
+        
+        if (e->down) {
+            input |= e->bit;
+            keysheld |= e->bit;
+            if (!*presstime)
+                *presstime = e->time;
+            if (e->bit & (IN_LEFT|IN_RIGHT)) {
+                shiftkey = e->bit;
+                shifttics = 0;
+            }
+        } else {
+            keysheld &= ~e->bit;
+            if (e->bit == shiftkey) { // carry on the other way if held
+                shiftkey = keysheld & (IN_LEFT|IN_RIGHT);
+                shifttics = 0;
+            }
+        }
+    }
+    
+    // auto repeat
+    if (shiftkey && !(input & shiftkey))
+    {
+        if (++shifttics >= das && (shifttics - das) % arr == 0)
+            input |= shiftkey;
+    }
+    
+    return input;
+}
+
+
+
+//====================
+//  LATENCY PROBE
+//====================
+
+//
+//  Time from a key press to the present of the first frame showing what
+//  it did, reported at exit.
+//
+
+#define LATENCY_SAMPLES 4096
+
+float       latency[LATENCY_SAMPLES]; // ms
+int         numlatency;
+Uint64      pendingpress; // key press not on screen yet, or 0
+
+
+void AddLatency (Uint64 presented)
+{
+    if (presented > pendingpress)
+        latency[numlatency++ % LATENCY_SAMPLES] =
+            (presented - pendingpress) * 1000.0 / SDL_GetPerformanceFrequency();
+    pendingpress = 0;
+}
+
+
+int CompareFloats (const void * a, const void * b)
+{
+    float fa = *(const float *)a;
+    float fb = *(const float *)b;
+    
+    return (fa > fb) - (fa < fb);
+}
+
+
+void ReportLatency (void)
+{
+    int     n, i;
+    float   sum;
+    
+    n = numlatency < LATENCY_SAMPLES ? numlatency : LATENCY_SAMPLES;
+    if (n == 0)
+        return;
+    
+    qsort(latency, n, sizeof(float), CompareFloats);
+    for (i=0, sum=0 ; i<n ; i++)
+        sum += latency[i];
+    printf("input latency: %d presses, mean %.1f ms, p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+           n, sum / n, latency[n / 2], latency[n * 99 / 100], latency[n - 1]);
+}
+
+
+
+#pragma mark -
+
+//
+//  GameKey
+//  The IN_* bit for a game key, or 0
+//
+int GameKey (SDL_Keycode key)
+{
+    switch (key)
+    {
+        case SDLK_SPACE:
+        case SDLK_UP:       return IN_ROTATE;
+        case SDLK_DOWN:     return IN_DROP;
+        case SDLK_LEFT:     return IN_LEFT;
+        case SDLK_RIGHT:    return IN_RIGHT;
+            
+            // debug:
+        case SDLK_EQUALS:   return IN_ADDLINES;
+        case SDLK_MINUS:    return IN_SUBLINES;
+            
+        default:
+            return 0;
+    }
+}
+
+
+//
+//  DoKeyDown
+//  Handle front end keys, and return the IN_* bit for a game key
+//
+int DoKeyDown (SDL_Keycode key)
 {
     // general input
     switch (key)
@@ -960,7 +2069,17 @@ void DoKeyDown (SDL_Keycode key)
         case SDLK_p:        ToggleOption(OPT_PAUSED);       break;
         case SDLK_g:        ToggleOption(OPT_SHOWGUIDE);    break;
         case SDLK_s:        ToggleOption(OPT_SOUND);        break;
-        case SDLK_t:        flatstyle = !flatstyle;         break;
+        case SDLK_t:
+            flatstyle = !flatstyle;
+            staticvalid = false;
+            break;
+            
+#ifdef PROFILE
+        case SDLK_f:
+            profoverlay = !profoverlay;
+            RedrawAll();
+            break;
+#endif
             
         case SDLK_c:
             SDL_SetWindowPosition(window,SDL_WINDOWPOS_CENTERED,SDL_WINDOWPOS_CENTERED);
@@ -977,85 +2096,327 @@ void DoKeyDown (SDL_Keycode key)
     // game input
 
     if (options[OPT_PAUSED])
+        return 0;
+    
+    return GameKey(key);
+}
+
+
+//====================
+//  REPLAYS
+//====================
+
+//
+//  SaveRecording
+//  Write out the game being recorded, only the first game is.
+//
+void SaveRecording (void)
+{
+    if (!recordfile)
         return;
     
-    switch (key)
-    {
-        case SDLK_SPACE:
-        case SDLK_UP:
-            Random();
-            RotateTetramino();
-            break;
-            
-        case SDLK_DOWN:
-            Random();
-            while (MoveTetramino(0, 1));
-            AddTetraminoToBoard();
-            score += 5;
-            cycletimer = 0;
-            PlaySound(SND_DROP);
-            break;
-            
-        case SDLK_LEFT:
-            Random();
-            if (MoveTetramino(-1, 0))
-                PlaySound(SND_MOVE);
-            break;
-            
-        case SDLK_RIGHT:
-            Random();
-            if (MoveTetramino(1, 0))
-                PlaySound(SND_MOVE);
-            break;
-            
-            // debug:
-        case SDLK_EQUALS:
-            numlines += LINES_PER_LVL;
-            break;
-        case SDLK_MINUS:
-            numlines -= LINES_PER_LVL;
-            if (numlines < 0) numlines = 0;
-            break;
-            
-        default:
-            break;
+    FinishReplay(&recording, &game);
+    if (WriteReplay(&recording, recordfile, REPLAY_KEYINTERVAL))
+        printf("replay saved to %s\n", recordfile);
+    else
+        printf("Error! Could not write replay %s\n", recordfile);
+    FreeReplay(&recording);
+    recordfile = NULL;
+}
+
+
+// print how a replay ended up against how it was recorded
+bool ReportReplay (const replayfile_t * r, const game_state_t * g)
+{
+    bool ok = CheckReplay(r, g);
+    
+    printf("replay %s: frame %d score %d lines %d level %d",
+           ok ? "verified" : "MISMATCH", g->frame, g->score, g->numlines, g->level);
+    if (!ok)
+        printf(" (recorded frame %d score %d lines %d level %d)",
+               r->frames, r->score, r->lines, r->level);
+    printf("\n");
+    return ok;
+}
+
+
+void EndPlayback (void)
+{
+    DrawAll();
+    ReportReplay(&playback, &game);
+    SDL_Delay(1000);
+    Quit(NULL);
+}
+
+
+
+
+//
+//  WaitUntil
+//  SDL_Delay can oversleep by a whole scheduler quantum, so only sleep
+//  until close to 'target' and spin for the rest. Spinning is only
+//  worth it when something will be drawn at 'target', otherwise a
+//  late wake-up costs nothing and it sleeps a millisecond at a time.
+//
+void WaitUntil (Uint64 target, bool spin)
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+    Uint64 margin = SDL_GetPerformanceFrequency() * SPIN_MS / 1000;
+    
+    if (!spin) {
+        while (SDL_GetPerformanceCounter() < target)
+            SDL_Delay(1);
+        return;
     }
+    if (target > now + margin)
+        SDL_Delay((Uint32)((target - now - margin) * 1000 / SDL_GetPerformanceFrequency()));
+    while (SDL_GetPerformanceCounter() < target)
+        ;
 }
 
 
+
+
+//
+//  PlayLoop
+//  The game steps at a fixed TICRATE, catching up after a stall, so all
+//  of its timers count the same frames whatever the display is doing.
+//  The screen is drawn separately at drawrate, or straight away when a
+//  key press changed something.
+//
 void PlayLoop (void)
 {
     SDL_Event   event;
-    int         tics;
-    int         elapsed;
-    int         starttime;
-
-    InitGame();
-    tics = cyclelength;
+    int         input;
+    int         events;
+    int         bit;
+    Uint64      now, last;
+    Uint64      due, presstime;
+    Uint64      accumulator;
+    Uint64      ticklength, drawlength;
+    Uint64      nexttick, nextdraw;
+    bool        presented; // by the last draw, else the screen is static
+    uint64_t    seed;
+
+    if (playing) {
+        if (!SeekReplay(&playback, seekframe, &game, &playcursor))
+            Quit("Error! Bad keyframe in replay");
+        RedrawAll();
+    } else {
+        seed = NewSeed();
+        InitGame(&game, seed, gameflags);
+        if (recordfile)
+            InitReplay(&recording, seed, gameflags);
+    }
+    
+    ticklength = SDL_GetPerformanceFrequency() / TICRATE;
+    drawlength = SDL_GetPerformanceFrequency() / drawrate;
+    last = nextdraw = SDL_GetPerformanceCounter();
+    accumulator = 0;
+    presented = true;
+    ClearKeys();
     
     do
     {
-        starttime = SDL_GetTicks();
+        PROF_BEGIN(PH_FRAME);
+        now = SDL_GetPerformanceCounter();
+        accumulator += now - last;
+        last = now;
+        if (accumulator > MAX_CATCHUP * ticklength)
+            accumulator = MAX_CATCHUP * ticklength; // give up on the rest
         
+        PROF_BEGIN(PH_EVENTS);
         while (SDL_PollEvent(&event))
         {
+            DoRenderEvent(&event);
             if (event.type == SDL_QUIT)
                 Quit(NULL);
-            if (event.type == SDL_KEYDOWN)
-                DoKeyDown(event.key.keysym.sym);
+            if (event.type == SDL_KEYDOWN && !event.key.repeat
+                && (bit = DoKeyDown(event.key.keysym.sym)))
+                QueueKey(EventTime(event.key.timestamp, now), bit, true);
+            if (event.type == SDL_KEYUP && (bit = GameKey(event.key.keysym.sym)))
+                QueueKey(EventTime(event.key.timestamp, now), bit, false);
         }
+        PROF_END(PH_EVENTS);
         
-        if (!options[OPT_PAUSED]) {
-            UpdateGame();
+        // don't catch up on time spent in another screen (see IncognitoMode)
+        if (SDL_GetPerformanceCounter() - now > MAX_CATCHUP * ticklength)
+            last = SDL_GetPerformanceCounter();
+        
+        PROF_BEGIN(PH_UPDATE);
+        while (accumulator >= ticklength && gamestate == GS_PLAY)
+        {
+            due = now - accumulator + ticklength; // when this step came due
+            accumulator -= ticklength;
+            if (options[OPT_PAUSED]) {
+                ClearKeys();
+                continue;
+            }
+            
+            if (playing) {
+                input = CursorInput(&playcursor, game.frame);
+                presstime = 0;
+            } else if (autoplay) {
+                input = BotInput(&bot, &game);
+                presstime = 0;
+            } else {
+                input = TakeInput(due, &presstime);
+            }
+            if (recordfile && !RecordInput(&recording, game.frame, input))
+                Quit("Error! Out of memory for recording");
+            
+            events = StepGame(&game, input);
+            if (presstime && !pendingpress && (events & (EV_MOVE|EV_ROTATE|EV_DROP)))
+                pendingpress = presstime;
+            PlayEvents(events);
+            if (game.gameover)
+                gamestate = GS_GAMEOVER;
+            if (playing && (game.gameover || game.frame >= playback.frames))
+                EndPlayback();
         }
+        PROF_END(PH_UPDATE);
         
-        DrawAll();
+        if (now >= nextdraw || pendingpress) {
+            presented = DrawAll();
+            if (presented && pendingpress)
+                AddLatency(SDL_GetPerformanceCounter());
+            nextdraw += drawlength;
+            if (nextdraw < now)
+                nextdraw = now + drawlength; // fell behind, don't rush
+        }
+        
+        PROF_END(PH_FRAME);
+        PROF_FRAME();
         
-        elapsed = SDL_GetTicks() - starttime;
-        if (elapsed < MS_PER_FRAME)
-            SDL_Delay(MS_PER_FRAME - elapsed);
-        tics++;
+        // a step can change the screen unless paused, a draw is only
+        // likely to if the last one did
+        nexttick = last + ticklength - accumulator;
+        if (nexttick < nextdraw)
+            WaitUntil(nexttick, !options[OPT_PAUSED]);
+        else
+            WaitUntil(nextdraw, presented);
     } while (gamestate == GS_PLAY);
+    
+    SaveRecording();
+}
+
+
+
+
+//====================
+//  HEADLESS
+//====================
+
+//
+//  With -headless there is no window: a scripted game is stepped and drawn
+//  into an offscreen surface as fast as it will go, and every frame's
+//  pixels are hashed. The hashes only change if what gets drawn does, so
+//  they show whether a change to the drawing code is bit-exact.
+//
+//  -reference turns off every drawing cache: the tile atlas, the static
+//  and frame layers, damage tracking, the drop guide texture and the text
+//  cache. It has to give the same hashes as without it for the same seed.
+//
+
+#define FNV_OFFSET      0xcbf29ce484222325ull
+#define FNV_PRIME       0x100000001b3ull
+
+uint64_t HashBytes (uint64_t hash, const void * data, size_t size)
+{
+    const uint8_t * p = data;
+    
+    while (size--)
+        hash = (hash ^ *p++) * FNV_PRIME;
+    return hash;
+}
+
+
+uint64_t HashScreen (void)
+{
+    uint64_t        hash = FNV_OFFSET;
+    const uint8_t * row;
+    int             y;
+    
+    SDL_LockSurface(screen);
+    row = screen->pixels;
+    for (y=0 ; y<screen->h ; y++, row+=screen->pitch)
+        hash = HashBytes(hash, row, screen->w * screen->format->BytesPerPixel);
+    SDL_UnlockSurface(screen);
+    
+    return hash;
+}
+
+
+//
+//  ScriptInput
+//  Same sort of key mashing as sim.c, from a seeded generator so a run
+//  can be repeated exactly.
+//
+int ScriptInput (uint32_t * rng)
+{
+    int input = 0;
+    
+    *rng = *rng * 1664525 + 1013904223;
+    switch ((*rng >> 16) % 16)
+    {
+        case 0:     input = IN_ROTATE;  break;
+        case 1:     input = IN_LEFT;    break;
+        case 2:     input = IN_RIGHT;   break;
+        default:    break;
+    }
+    if ((*rng >> 8) % 64 == 0)
+        input |= IN_DROP;
+    
+    return input;
+}
+
+
+void HeadlessLoop (int numframes, uint64_t seed, const char * hashfile)
+{
+    FILE *      stream = NULL;
+    uint32_t    rng = seed;
+    uint64_t    hash, total = FNV_OFFSET;
+    Uint64      start, drawstart, drawtime = 0;
+    double      seconds, drawseconds;
+    int         frame, games = 1;
+    
+    if (hashfile) {
+        stream = fopen(hashfile, "w");
+        if (!stream)
+            Quit("Error! Could not open hash file");
+    }
+    
+    InitGame(&game, seed, gameflags);
+    fxrng = game.rng;
+    JumpRandom(&fxrng); // effects get a stream of their own, from the same seed
+    start = SDL_GetPerformanceCounter();
+    
+    for (frame=0 ; frame<numframes ; frame++)
+    {
+        StepGame(&game, autoplay ? BotInput(&bot, &game) : ScriptInput(&rng));
+        if (game.gameover) { // start over so there's always something to draw
+            InitGame(&game, seed + games++, gameflags);
+            RedrawAll();
+        }
+        
+        drawstart = SDL_GetPerformanceCounter();
+        DrawAll();
+        drawtime += SDL_GetPerformanceCounter() - drawstart;
+        
+        hash = HashScreen();
+        total = HashBytes(total, &hash, sizeof(hash));
+        if (stream)
+            fprintf(stream, "%d %016llx\n", frame, (unsigned long long)hash);
+    }
+    
+    seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    drawseconds = (double)drawtime / SDL_GetPerformanceFrequency();
+    if (stream)
+        fclose(stream);
+    
+    printf("%d frames, %d games in %.3f s: %.1f frames/s, %.1f frames/s drawing only\n",
+           numframes, games, seconds, numframes / seconds, numframes / drawseconds);
+    printf("frame hash %016llx\n", (unsigned long long)total);
 }
 
 
@@ -1064,17 +2425,16 @@ void PlayLoop (void)
 //
 // HighScores
 // Do the whole 'high scores screen' thing.
-// High scores are saved to disk in scores.dat and are
-// loaded into the 'scores' array
+// The table comes from topscores, read from the journal at startup,
+// and a new entry is saved with AddScore once it has a name.
 //
 void HighScores (void)
 {
     const uint8_t * keystate;
-    const char * filename = "scores.dat";
     const int   scorestarty = 5;
     
     SDL_Event   event;
-    FILE *      stream;
+    score_t     scores[TOP_SCORES];
     int         i;
     int         index;          // index of the new high score
     bool        getname;        // get name input?
@@ -1083,24 +2443,7 @@ void HighScores (void)
     int         bufindex;
     char        buffer[NAME_SIZE];
 
-    //
-    // load previous scores from file into scores[]
-    //
-    
-    stream = fopen(filename, "r");
-    if (stream) {
-        fread(scores, sizeof(score), 10, stream);
-    } else { // scores.dat doesn't exist(?)
-        stream = fopen(filename, "w"); // create it
-        if (!stream)
-            Quit("Error! Could not create scores.dat file");
-        for (i=0 ; i<10 ; i++) { // init empty scores
-            scores[i].level = 0;
-            scores[i].score = 0;
-            memset(scores[i].name, 0, NAME_SIZE);
-        }
-    }
-    fclose(stream);
+    memcpy(scores, topscores, sizeof(scores));
     
     
     //
@@ -1108,10 +2451,7 @@ void HighScores (void)
     // index == 10 means player didn't make it on the board >:[
     //
     
-    for (i=0 ; i<10 ; i++)
-        if (score > scores[i].score)
-            break;
-    index = i;
+    index = ScoreRank(game.score);
 
     
     //
@@ -1122,8 +2462,8 @@ void HighScores (void)
     {
         if (index < 9) // middle of list, move lower scores down one
             memmove(&scores[index + 1], &scores[index], sizeof(score_t)*(9-index));
-        scores[index].score = score;
-        scores[index].level = level;
+        scores[index].score = game.score;
+        scores[index].level = game.level;
         memset(scores[index].name, 0, NAME_SIZE);
     }
     
@@ -1143,6 +2483,7 @@ void HighScores (void)
     {
         while (SDL_PollEvent(&event))
         {
+            DoRenderEvent(&event);
             if (event.type == SDL_QUIT)
                 Quit(NULL);
             
@@ -1161,14 +2502,9 @@ void HighScores (void)
                     }
                     else if (event.key.keysym.sym == SDLK_RETURN) {
                         getname = false;
-                        strncpy(scores[index].name, buffer, sizeof(NAME_SIZE));
+                        memcpy(scores[index].name, buffer, NAME_SIZE);
+                        AddScore(&scores[index]); // written in the background
                         index = 10;
-                        // write the updated scores to disk
-                        fopen(filename, "wb");
-                        if (!stream)
-                            Quit("Error! Could not write to scores.dat. Sorry!");
-                        fwrite(scores, sizeof(score_t), 10, stream);
-                        fclose(stream);
                     }
                 }
                 
@@ -1178,6 +2514,8 @@ void HighScores (void)
                     if (event.key.keysym.sym == SDLK_y) {
                         gamestate = GS_PLAY;
                         SDL_RenderSetScale(renderer, DRAW_SCALE, DRAW_SCALE);
+                        centertext = NULL;
+                        RedrawAll();
                         return;
                     }
                     if (event.key.keysym.sym == SDLK_n)
@@ -1240,15 +2578,15 @@ void GameOver (void)
 {
     int x, y;
     
-    y = tet.y;
+    y = game.tet.y;
     
     SDL_PumpEvents();
     while (1)
     {
-        for (x=0 ; x<BOARD_W ; x++)
+        for (x=0 ; x<BOARD_W && y<BOARD_H ; x++)
         {
-            if (board[y][x] != -1)
-                board[y][x] = TET_DEAD;
+            if (game.board[y][x] != -1)
+                game.board[y][x] = TET_DEAD;
         }
         
         DrawAll();
@@ -1260,9 +2598,8 @@ void GameOver (void)
         SDL_Delay(45);
     }
 
+    centertext = "GAME OVER";
     DrawAll();
-    DrawCenterWindow("GAME OVER", false);
-    SDL_RenderPresent(renderer);
 
     SDL_Delay(1500);
     HighScores();
@@ -1271,9 +2608,105 @@ void GameOver (void)
 
 
 
+int CheckParm (int argc, const char * argv[], const char * parm)
+{
+    int i;
+    
+    for (i=1 ; i<argc ; i++)
+        if (!strcmp(argv[i], parm))
+            return i;
+    return 0;
+}
+
+
+
+
+//
+//  usage: tetris [-vsync] [-fps N] [-das N] [-arr N] [-bag] [-startup] [-assets dir]
+//         tetris -headless [-frames N] [-seed N] [-hashfile file] [-reference]
+//         tetris -autoplay [-beam N], with or without -headless
+//         tetris -record file
+//         tetris -play file [-seek frame] [-fast]
+//
 int main (int argc, const char * argv[])
 {
+    int p;
+    int numframes = 3600;
+    uint64_t seed = 0;
+    int beamwidth = BOT_BEAM;
+    const char * hashfile = NULL;
+    
+    launchtime = SDL_GetPerformanceCounter();
+    showstartup = CheckParm(argc, argv, "-startup") != 0;
+    if ((p = CheckParm(argc, argv, "-assets")) && p < argc-1)
+        assetdir = argv[p+1];
+    vsync = CheckParm(argc, argv, "-vsync") != 0;
+    if ((p = CheckParm(argc, argv, "-fps")) && p < argc-1)
+        drawrate = atoi(argv[p+1]);
+    if ((p = CheckParm(argc, argv, "-das")) && p < argc-1)
+        das = atoi(argv[p+1]);
+    if ((p = CheckParm(argc, argv, "-arr")) && p < argc-1)
+        arr = atoi(argv[p+1]);
+    if (das < 1)
+        das = 1;
+    if (arr < 1)
+        arr = 1;
+    gameflags = CheckParm(argc, argv, "-bag") ? GM_BAG : 0;
+    SeedRandom(&fxrng, NewSeed());
+    ChooseBatchKernel(NULL);
+    
+    if ((p = CheckParm(argc, argv, "-record")) && p < argc-1)
+        recordfile = argv[p+1];
+    if ((p = CheckParm(argc, argv, "-play")) && p < argc-1)
+    {
+        if (!OpenReplay(&playback, argv[p+1])) {
+            printf("Error! Could not read replay %s\n", argv[p+1]);
+            return 1;
+        }
+        playing = true;
+        recordfile = NULL;
+        if ((p = CheckParm(argc, argv, "-seek")) && p < argc-1)
+            seekframe = atoi(argv[p+1]);
+        
+        // uncapped, no SDL at all
+        if (CheckParm(argc, argv, "-fast")) {
+            if (!PlayReplay(&playback, &game) && !game.frame) {
+                printf("Error! Bad keyframe in replay\n");
+                return 1;
+            }
+            return ReportReplay(&playback, &game) ? 0 : 1;
+        }
+    }
+    
+    autoplay = CheckParm(argc, argv, "-autoplay") != 0;
+    if ((p = CheckParm(argc, argv, "-beam")) && p < argc-1)
+        beamwidth = atoi(argv[p+1]);
+    if (autoplay && !InitBot(&bot, beamwidth)) {
+        printf("Error! Could not allocate the bot's search\n");
+        return 1;
+    }
+    headless = CheckParm(argc, argv, "-headless") != 0;
+    reference = CheckParm(argc, argv, "-reference") != 0;
+    if (headless)
+    {
+        if ((p = CheckParm(argc, argv, "-frames")) && p < argc-1)
+            numframes = atoi(argv[p+1]);
+        if ((p = CheckParm(argc, argv, "-seed")) && p < argc-1)
+            seed = strtoull(argv[p+1], NULL, 0);
+        if ((p = CheckParm(argc, argv, "-hashfile")) && p < argc-1)
+            hashfile = argv[p+1];
+        
+        Initialize();
+        HeadlessLoop(numframes, seed, hashfile);
+        Quit(NULL);
+    }
+    
     Initialize();
+    if (!OpenScores(SCORES_FILE))
+        printf("Error! Could not open %s, high scores won't be saved\n", SCORES_FILE);
+    if (badscores)
+        printf("%s: skipped %d damaged scores\n", SCORES_FILE, badscores);
+    MarkStage("scores");
     
     gamestate = GS_PLAY;
     